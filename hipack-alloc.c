@@ -39,7 +39,11 @@ hipack_alloc_stdlib (void *optr, size_t size)
 #define MUL_NO_OVERFLOW	((size_t)1 << (sizeof(size_t) * 4))
 
 void*
-hipack_alloc_array_extra (void *optr, size_t nmemb, size_t size, size_t extra)
+hipack_allocator_alloc_array_extra (const hipack_allocator_t *allocator,
+                                    void                     *optr,
+                                    size_t                    nmemb,
+                                    size_t                    size,
+                                    size_t                    extra)
 {
 	if ((nmemb >= MUL_NO_OVERFLOW || size >= MUL_NO_OVERFLOW) &&
         nmemb > 0 && SIZE_MAX / nmemb < size) {
@@ -47,7 +51,233 @@ hipack_alloc_array_extra (void *optr, size_t nmemb, size_t size, size_t extra)
         fflush (stderr);
         abort ();
     }
-	return (*hipack_alloc) (optr, size * nmemb + extra);
+	return hipack_allocator_alloc (allocator, optr, size * nmemb + extra);
+}
+
+
+void*
+hipack_alloc_array_extra (void *optr, size_t nmemb, size_t size, size_t extra)
+{
+    return hipack_allocator_alloc_array_extra (NULL, optr, nmemb, size, extra);
+}
+
+
+#ifndef HIPACK_ARENA_BLOCK_SIZE
+#define HIPACK_ARENA_BLOCK_SIZE (64 * 1024)
+#endif /* !HIPACK_ARENA_BLOCK_SIZE */
+
+/* Alignment of blocks returned by the arena, must be a power of two. */
+#define ARENA_ALIGN 8
+#define ARENA_ROUND(_size) (((_size) + (ARENA_ALIGN - 1)) & ~((size_t) ARENA_ALIGN - 1))
+
+/*
+ * Each allocated chunk is preceded by a header which stores its size,
+ * which is needed to copy the contents of chunks when reallocating.
+ */
+#define ARENA_HEADER_SIZE ARENA_ROUND (sizeof (size_t))
+
+struct arena_block {
+    struct arena_block *next;
+    size_t              size;
+    size_t              used;
+    uint8_t            *data;
+};
+
+struct hipack_arena {
+    hipack_allocator_t  allocator;
+    void*             (*alloc) (void*, size_t);
+    struct arena_block *blocks;
+    size_t              block_size;
+};
+
+
+/*
+ * Blocks are (re)allocated using the allocation function which was set when
+ * the arena was created, so they are released using the same function even
+ * if hipack_alloc is changed afterwards.
+ */
+static struct arena_block*
+arena_block_resize (hipack_arena_t     *arena,
+                    struct arena_block *block,
+                    size_t              size)
+{
+    size_t header = ARENA_ROUND (sizeof (struct arena_block));
+    if (size > SIZE_MAX - header) {
+        fprintf (stderr, "aborted: %s\n", strerror (ENOMEM));
+        fflush (stderr);
+        abort ();
+    }
+    block = (*arena->alloc) (block, header + size);
+    block->size = block->used = size;
+    block->data = ((uint8_t*) block) + header;
+    return block;
+}
+
+
+static struct arena_block*
+arena_block_new (hipack_arena_t *arena, size_t size)
+{
+    struct arena_block *block = arena_block_resize (arena, NULL, size);
+    block->next = NULL;
+    block->used = 0;
+    return block;
+}
+
+
+static void* arena_allocator_alloc (void*, void*, size_t);
+static void  arena_allocator_free (void*, void*);
+
+
+hipack_arena_t*
+hipack_arena_new (size_t block_size)
+{
+    hipack_arena_t *arena = (*hipack_alloc) (NULL, sizeof (hipack_arena_t));
+    arena->allocator = (hipack_allocator_t) {
+        .alloc = arena_allocator_alloc,
+        .free  = arena_allocator_free,
+        .user  = arena,
+    };
+    arena->alloc = hipack_alloc;
+    arena->block_size = ARENA_ROUND (block_size ? block_size
+                                                : HIPACK_ARENA_BLOCK_SIZE);
+    arena->blocks = arena_block_new (arena, arena->block_size);
+    return arena;
+}
+
+
+void
+hipack_arena_free (hipack_arena_t *arena)
+{
+    if (arena) {
+        struct arena_block *next;
+        for (struct arena_block *block = arena->blocks; block; block = next) {
+            next = block->next;
+            (*arena->alloc) (block, 0);
+        }
+        (*arena->alloc) (arena, 0);
+    }
+}
+
+
+static inline size_t
+chunk_size (const void *ptr)
+{
+    return *((const size_t*) (((const uint8_t*) ptr) - ARENA_HEADER_SIZE));
+}
+
+
+/* Checks whether "ptr" is the last chunk allocated from the current block. */
+static inline bool
+is_last_chunk (const struct arena_block *block, const void *ptr)
+{
+    return ((const uint8_t*) ptr) + ARENA_ROUND (chunk_size (ptr)) ==
+        block->data + block->used;
+}
+
+
+/* Checks whether "ptr" is the only chunk allocated from a block. */
+static inline bool
+is_sole_chunk (const struct arena_block *block, const void *ptr)
+{
+    return block && ptr == block->data + ARENA_HEADER_SIZE &&
+        block->used == ARENA_HEADER_SIZE + ARENA_ROUND (chunk_size (ptr));
+}
+
+
+static void*
+arena_chunk_new (hipack_arena_t *arena, size_t size)
+{
+    size_t needed = ARENA_HEADER_SIZE + ARENA_ROUND (size);
+    struct arena_block *block = arena->blocks;
+
+    if (needed > block->size - block->used) {
+        if (needed > arena->block_size / 4) {
+            /*
+             * Big chunks get a block of their own, placed after the
+             * current block, which is kept around to continue serving
+             * small allocations.
+             */
+            struct arena_block *big = arena_block_new (arena, needed);
+            big->next = block->next;
+            block->next = big;
+            block = big;
+        } else {
+            block = arena_block_new (arena, arena->block_size);
+            block->next = arena->blocks;
+            arena->blocks = block;
+        }
+    }
+
+    uint8_t *chunk = block->data + block->used;
+    *((size_t*) chunk) = size;
+    block->used += needed;
+    return chunk + ARENA_HEADER_SIZE;
+}
+
+
+void*
+hipack_arena_alloc (hipack_arena_t *arena, void *optr, size_t size)
+{
+    assert (arena);
+
+    struct arena_block *block = arena->blocks;
+
+    if (!size) {
+        /*
+         * Memory is released all at once by hipack_arena_free(), but the
+         * space used by the last allocated chunk can be reused right away.
+         */
+        if (optr && is_last_chunk (block, optr))
+            block->used -= ARENA_HEADER_SIZE + ARENA_ROUND (chunk_size (optr));
+        return NULL;
+    }
+
+    if (!optr)
+        return arena_chunk_new (arena, size);
+
+    size_t old_size = chunk_size (optr);
+    if (is_last_chunk (block, optr)) {
+        /* Try to grow or shrink the chunk in place. */
+        size_t start = block->used - ARENA_ROUND (old_size);
+        if (ARENA_ROUND (size) <= block->size - start) {
+            block->used = start + ARENA_ROUND (size);
+            *((size_t*) (((uint8_t*) optr) - ARENA_HEADER_SIZE)) = size;
+            return optr;
+        }
+    } else if (size <= old_size) {
+        return optr;
+    } else if (is_sole_chunk (block->next, optr)) {
+        /* Big chunk in a block of its own: resize the whole block. */
+        struct arena_block *big = arena_block_resize (arena, block->next,
+                                                      ARENA_HEADER_SIZE + ARENA_ROUND (size));
+        *((size_t*) big->data) = size;
+        block->next = big;
+        return big->data + ARENA_HEADER_SIZE;
+    }
+
+    void *ptr = arena_chunk_new (arena, size);
+    memcpy (ptr, optr, (size < old_size) ? size : old_size);
+    return ptr;
 }
 
 
+static void*
+arena_allocator_alloc (void *arena, void *optr, size_t size)
+{
+    return hipack_arena_alloc ((hipack_arena_t*) arena, optr, size);
+}
+
+
+static void
+arena_allocator_free (void *arena, void *ptr)
+{
+    hipack_arena_alloc ((hipack_arena_t*) arena, ptr, 0);
+}
+
+
+const hipack_allocator_t*
+hipack_arena_allocator (hipack_arena_t *arena)
+{
+    assert (arena);
+    return &arena->allocator;
+}
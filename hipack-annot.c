@@ -0,0 +1,186 @@
+/*
+ * hipack-annot.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+/*
+ * Annotations of a value are stored in a single block, as a sequence of
+ * hipack_string_t records padded to a multiple of four bytes so that each
+ * one is properly aligned. Values usually have a handful of short names,
+ * so a linear scan is faster than hashing, and adding, checking, and
+ * removing names do not allocate memory unless the block needs to grow.
+ * The block is freed when the last annotation is removed, so a value has
+ * annotations if and only if hipack_value_annot() is not NULL. The pointer
+ * to the block shares the "tag" member of hipack_value_t with the type,
+ * which relies on allocators returning memory aligned to eight bytes.
+ */
+
+#include "hipack.h"
+#include <string.h>
+
+
+/* Room for a few short names, with the header the block takes 64 bytes. */
+#ifndef HIPACK_ANNOT_DEFAULT_SIZE
+#define HIPACK_ANNOT_DEFAULT_SIZE 48
+#endif /* !HIPACK_ANNOT_DEFAULT_SIZE */
+
+
+struct hipack_annot {
+    const hipack_allocator_t *allocator;
+    uint32_t size;  /* Bytes used in "data". */
+    uint32_t alloc; /* Bytes available in "data". */
+    uint8_t  data[];
+};
+
+
+static inline void
+set_annot (hipack_value_t *value, hipack_annot_t *annot)
+{
+    assert (!((uintptr_t) annot & HIPACK_VALUE_TYPE_MASK));
+    value->tag = (uintptr_t) annot | hipack_value_type (value);
+}
+
+
+static inline uint32_t
+record_size (uint32_t length)
+{
+    return (sizeof (hipack_string_t) + length + 3) & ~UINT32_C (3);
+}
+
+
+static inline const hipack_string_t*
+record_at (const hipack_annot_t *annot, uint32_t offset)
+{
+    return (const hipack_string_t*) (annot->data + offset);
+}
+
+
+static const hipack_string_t*
+annot_find (const hipack_annot_t *annot, const char *name, uint32_t length)
+{
+    for (uint32_t offset = 0; offset < annot->size;) {
+        const hipack_string_t *record = record_at (annot, offset);
+        if (record->size == length && !memcmp (record->data, name, length))
+            return record;
+        offset += record_size (record->size);
+    }
+    return NULL;
+}
+
+
+void
+hipack_annot_free (hipack_annot_t *annot)
+{
+    if (annot)
+        hipack_allocator_free (annot->allocator, annot);
+}
+
+
+bool
+hipack_value_add_annot_lstring_with_allocator (const hipack_allocator_t *allocator,
+                                               hipack_value_t           *value,
+                                               const char               *annot,
+                                               uint32_t                  length)
+{
+    assert (value);
+    assert (annot || !length);
+
+    hipack_annot_t *block = hipack_value_annot (value);
+    if (block && annot_find (block, annot, length))
+        return false;
+
+    const uint32_t needed = record_size (length);
+    if (!block || block->alloc - block->size < needed) {
+        uint32_t alloc = block ? block->alloc * 2 : HIPACK_ANNOT_DEFAULT_SIZE;
+        while (alloc < (block ? block->size : 0) + needed)
+            alloc *= 2;
+
+        if (block)
+            allocator = block->allocator;
+        block = hipack_allocator_alloc (allocator, block,
+                                        sizeof (hipack_annot_t) + alloc);
+        if (!hipack_value_annot (value)) {
+            block->allocator = allocator;
+            block->size = 0;
+        }
+        block->alloc = alloc;
+        set_annot (value, block);
+    }
+
+    hipack_string_t *record = (hipack_string_t*) (block->data + block->size);
+    record->size = length;
+    memcpy (record->data, annot, length);
+    block->size += needed;
+    return true;
+}
+
+
+void
+hipack_value_add_annot (hipack_value_t *value,
+                        const char     *annot)
+{
+    assert (annot);
+    hipack_value_add_annot_lstring_with_allocator (NULL, value, annot,
+                                                   strlen (annot));
+}
+
+
+bool
+hipack_value_has_annot (const hipack_value_t *value,
+                        const char           *annot)
+{
+    assert (value);
+    assert (annot);
+
+    const hipack_annot_t *block = hipack_value_annot (value);
+    return block && annot_find (block, annot, strlen (annot));
+}
+
+
+void
+hipack_value_del_annot (hipack_value_t *value,
+                        const char     *annot)
+{
+    assert (value);
+    assert (annot);
+
+    hipack_annot_t *block = hipack_value_annot (value);
+    if (!block)
+        return;
+
+    const hipack_string_t *record = annot_find (block, annot, strlen (annot));
+    if (!record)
+        return;
+
+    uint32_t offset = (const uint8_t*) record - block->data;
+    uint32_t skip = record_size (record->size);
+    block->size -= skip;
+
+    if (block->size) {
+        memmove (block->data + offset, block->data + offset + skip,
+                 block->size - offset);
+    } else {
+        hipack_annot_free (block);
+        set_annot (value, NULL);
+    }
+}
+
+
+const hipack_string_t*
+hipack_value_annot_next (const hipack_value_t  *value,
+                         const hipack_string_t *annot)
+{
+    assert (value);
+
+    const hipack_annot_t *block = hipack_value_annot (value);
+    if (!block)
+        return NULL;
+    if (!annot)
+        return record_at (block, 0);
+
+    uint32_t offset = ((const uint8_t*) annot - block->data)
+                    + record_size (annot->size);
+    return (offset < block->size) ? record_at (block, offset) : NULL;
+}
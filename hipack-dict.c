@@ -6,126 +6,424 @@
  */
 
 #include "hipack.h"
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
 
+/*
+ * Dictionaries are hash tables with open addressing. Entries are stored in
+ * a dense array, in insertion order, and the table itself ("index") is an
+ * array of slots which contain either zero (empty slot), or the position
+ * of an entry in the array plus one. Collisions are resolved using linear
+ * probing, and removing entries shifts back the slots which follow them,
+ * so there are no deleted slots in the index.
+ *
+ * Keys of up to HIPACK_DICT_INLINE_KEY_SIZE bytes are stored in the entries,
+ * laid out as a hipack_string_t, and bigger ones are referenced using a
+ * pointer. The size of the key tells them apart. Removed entries are marked
+ * using a special key size, and are skipped when iterating. The entry after
+ * the last one in use always has a zero key size, and marks the end of the
+ * array for iteration.
+ *
+ * The entries array and the index are allocated together, in a single
+ * memory block.
+ *
+ * Frozen dictionaries (see hipack_dict_freeze()) store also the keys in
+ * the same block, and use a perfect hash function built with the "hash,
+ * displace, and compress" algorithm by Belazzougui, Botelho, and
+ * Dietzfelbinger: keys are split in buckets using their hash value, and
+ * for each bucket a displacement value is chosen which maps all the keys
+ * of the bucket to free slots. The displacements are stored in the index
+ * after the slots. Buckets with a single key store the slot directly.
+ * If no perfect hash function is found, frozen dictionaries use the same
+ * kind of index as mutable ones.
+ */
+
+/* Initial number of slots of the index. Must be a power of two. */
 #ifndef HIPACK_DICT_DEFAULT_SIZE
-#define HIPACK_DICT_DEFAULT_SIZE 16
+#define HIPACK_DICT_DEFAULT_SIZE 8
 #endif /* !HIPACK_DICT_DEFAULT_SIZE */
 
-#ifndef HIPACK_DICT_RESIZE_FACTOR
-#define HIPACK_DICT_RESIZE_FACTOR 3
-#endif /* !HIPACK_DICT_RESIZE_FACTOR */
+/* Maximum percentage of slots of the index which may be in use. */
+#ifndef HIPACK_DICT_MAX_LOAD
+#define HIPACK_DICT_MAX_LOAD 75
+#endif /* !HIPACK_DICT_MAX_LOAD */
+
+/* Number of displacement values tried for each bucket when freezing. */
+#ifndef HIPACK_DICT_FREEZE_MAX_TRIES
+#define HIPACK_DICT_FREEZE_MAX_TRIES 65536
+#endif /* !HIPACK_DICT_FREEZE_MAX_TRIES */
+
+/* Average number of keys per bucket of frozen dictionaries. */
+#define FROZEN_BUCKET_KEYS 4
 
-#ifndef HIPACK_DICT_COUNT_TO_SIZE_RATIO
-#define HIPACK_DICT_COUNT_TO_SIZE_RATIO 1.2
-#endif /* !HIPACK_DICT_COUNT_TO_SIZE_RATIO */
+/* Flag for displacements which contain directly the slot of the key. */
+#define FROZEN_DIRECT_SLOT UINT32_C (0x80000000)
+
+#define CHECK_NOT_FROZEN(_dict, ...)                     \
+    do {                                                 \
+        assert (!(_dict)->frozen);                       \
+        if ((_dict)->frozen) return __VA_ARGS__;         \
+    } while (0)
+
+
+/* Special key sizes. Keys stored in the entries are never empty. */
+#define KEY_END       UINT32_C (0)
+#define KEY_DELETED   UINT32_C (0xFFFFFFFE)
+#define KEY_EXTERNAL  UINT32_C (0xFFFFFFFF)
+
+/* Flags for dict_set(). */
+enum {
+    KEY_BORROWED   = 1 << 0, /* The key is not freed by the dictionary. */
+    KEY_NOT_INLINE = 1 << 1, /* The key pointer is kept, even if short. */
+};
 
 
 struct hipack_dict_node {
-    hipack_value_t      value;
-    hipack_string_t    *key;
-    hipack_dict_node_t *next;
-    hipack_dict_node_t *next_node;
-    hipack_dict_node_t *prev_node;
+    hipack_value_t value;
+    uint32_t       hash;
+    uint32_t       key_size; /* With key_data, a hipack_string_t. */
+    union {
+        uint8_t key_data[HIPACK_DICT_INLINE_KEY_SIZE];
+        struct {
+            hipack_string_t *key;
+            bool             borrowed;
+        } external;
+    };
 };
 
+/*
+ * node_key() uses key_size and key_data as a hipack_string_t, which needs
+ * key_data to be placed where the data of the string would be. This fails
+ * to compile (negative array size) on ABIs where that is not the case.
+ */
+typedef char node_key_layout_check[
+    (offsetof (hipack_dict_node_t, key_data) ==
+     offsetof (hipack_dict_node_t, key_size) +
+     offsetof (hipack_string_t, data)) ? 1 : -1];
 
-static inline hipack_dict_node_t*
-make_node (hipack_string_t *key,
-           const hipack_value_t  *value)
+
+struct hipack_intern {
+    hipack_dict_t    dict;
+};
+
+
+static inline uint32_t
+dict_capacity (uint32_t size)
 {
-    assert (key->size);
-    hipack_dict_node_t *node =
-            hipack_alloc_bzero (sizeof (hipack_dict_node_t));
-    memcpy (&node->value, value, sizeof (hipack_value_t));
-    node->key = key;
-    return node;
+    return (uint32_t) (((uint64_t) size * HIPACK_DICT_MAX_LOAD) / 100);
+}
+
+
+/* Fibonacci hashing: uses the upper bits of the hash multiplied by 2^32/phi */
+static inline uint32_t
+dict_slot (const hipack_dict_t *dict, uint32_t hash)
+{
+    return (hash * UINT32_C (2654435769)) >> dict->shift;
+}
+
+
+static inline bool
+is_live_node (const hipack_dict_node_t *node)
+{
+    return node->key_size != KEY_END && node->key_size != KEY_DELETED;
 }
 
 
+static inline const hipack_string_t*
+node_key (const hipack_dict_node_t *node)
+{
+    return (node->key_size == KEY_EXTERNAL)
+        ? node->external.key
+        : (const hipack_string_t*) &node->key_size;
+}
+
+
+/* Frees the key of an entry, unless it is inline or borrowed. */
 static inline void
-free_node (hipack_dict_node_t *node)
+node_free_key (hipack_dict_t *dict, hipack_dict_node_t *node)
 {
-    hipack_string_free (node->key);
-    hipack_value_free (&node->value);
-    hipack_alloc_free (node);
+    if (node->key_size == KEY_EXTERNAL && !node->external.borrowed)
+        hipack_string_free_with_allocator (dict->allocator, node->external.key);
 }
 
 
-static void
-free_all_nodes (hipack_dict_t *dict)
+static inline uint32_t
+round_pow2 (uint32_t n)
+{
+    return (n <= 1) ? 1 : UINT32_C (1) << (32 - __builtin_clz (n - 1));
+}
+
+
+/* Slot of a key in a frozen dictionary, for a given displacement. */
+static inline uint32_t
+frozen_slot (const hipack_dict_t *dict, uint32_t hash, uint32_t displacement)
+{
+    return ((hash ^ displacement) * UINT32_C (2654435769)) >> dict->shift;
+}
+
+
+static inline uint32_t
+frozen_find_slot (const hipack_dict_t *dict, uint32_t hash)
+{
+    uint32_t displacement = dict->index[dict->size + (hash & (dict->buckets - 1))];
+    return (displacement & FROZEN_DIRECT_SLOT)
+        ? displacement & ~FROZEN_DIRECT_SLOT
+        : frozen_slot (dict, hash, displacement);
+}
+
+
+/*
+ * Interned keys are the same pointer, which is checked first to avoid
+ * comparing their contents. Otherwise hashes are compared before the
+ * contents, to avoid comparing most of the keys.
+ */
+static inline bool
+node_has_key (const hipack_dict_node_t *node,
+              const uint8_t            *data,
+              uint32_t                  size,
+              uint32_t                  hash)
+{
+    const hipack_string_t *key = node_key (node);
+    if (key->data == data && key->size == size)
+        return true;
+
+    return node->hash == hash && key->size == size &&
+        memcmp (key->data, data, size) == 0;
+}
+
+
+/*
+ * Finds the slot of the index which refers to the entry for a key, or the
+ * empty slot where a reference to a new entry for the key would be stored.
+ */
+static inline uint32_t
+dict_find_slot (const hipack_dict_t *dict,
+                const uint8_t       *data,
+                uint32_t             size,
+                uint32_t             hash)
 {
-    hipack_dict_node_t *next;
+    const uint32_t mask = dict->size - 1;
+    uint32_t slot = dict_slot (dict, hash);
 
-    for (hipack_dict_node_t *node = dict->first; node; node = next) {
-        next = node->next_node;
-        free_node (node);
+    for (;; slot = (slot + 1) & mask) {
+        uint32_t entry = dict->index[slot];
+        if (!entry || node_has_key (&dict->entries[entry - 1], data, size, hash))
+            return slot;
     }
 }
 
 
-static inline void
-rehash (hipack_dict_t *dict)
-{
-    for (hipack_dict_node_t *node = dict->first; node; node = node->next_node)
-        node->next = NULL;
-
-    dict->size *= HIPACK_DICT_RESIZE_FACTOR;
-    dict->nodes = hipack_alloc_array (dict->nodes,
-                                      sizeof (hipack_dict_node_t*),
-                                      dict->size);
-    memset (dict->nodes, 0, sizeof (hipack_dict_node_t*) * dict->size);
-
-    for (hipack_dict_node_t *node = dict->first; node; node = node->next_node) {
-        uint32_t hash_val = hipack_string_hash (node->key) % dict->size;
-        hipack_dict_node_t *n = dict->nodes[hash_val];
-        if (!n) {
-            dict->nodes[hash_val] = node;
-        } else {
-            for (;; n = n->next) {
-                if (!n->next) {
-                    n->next = node;
-                    break;
-                }
-            }
-        }
+/*
+ * Reallocates the entries array and the index for a table of "size" slots,
+ * leaving out the removed entries.
+ */
+static void
+dict_resize (hipack_dict_t *dict, uint32_t size)
+{
+    assert (size >= HIPACK_DICT_DEFAULT_SIZE);
+    assert (!(size & (size - 1)));
+    assert (dict_capacity (size) >= dict->count);
+
+    /* One more entry is needed for the end marker. */
+    const uint32_t capacity = dict_capacity (size) + 1;
+    hipack_dict_node_t *entries =
+        hipack_allocator_alloc_array_extra (dict->allocator, NULL,
+                                            capacity,
+                                            sizeof (hipack_dict_node_t),
+                                            size * sizeof (uint32_t));
+    uint32_t *index = (uint32_t*) (entries + capacity);
+    memset (index, 0, size * sizeof (uint32_t));
+
+    hipack_dict_node_t *old_entries = dict->entries;
+    uint32_t used = 0;
+
+    dict->entries = entries;
+    dict->index = index;
+    dict->size = size;
+    dict->shift = 32 - __builtin_ctz (size);
+
+    for (uint32_t i = 0; i < dict->used; i++) {
+        if (!is_live_node (&old_entries[i]))
+            continue;
+
+        entries[used] = old_entries[i];
+        uint32_t slot = dict_slot (dict, entries[used].hash);
+        while (index[slot])
+            slot = (slot + 1) & (size - 1);
+        index[slot] = ++used;
     }
+    assert (used == dict->count);
+
+    dict->used = used;
+    entries[used].key_size = KEY_END;
+
+    hipack_allocator_free (dict->allocator, old_entries);
 }
 
 
 hipack_dict_t*
 hipack_dict_new (void)
 {
-    hipack_dict_t *dict = hipack_alloc_bzero (sizeof (hipack_dict_t));
-    dict->size  = HIPACK_DICT_DEFAULT_SIZE;
-    dict->nodes = hipack_alloc_array (NULL,
-                                      sizeof (hipack_dict_node_t*),
-                                      dict->size);
-    memset (dict->nodes, 0, sizeof (hipack_dict_node_t*) * dict->size);
+    return hipack_dict_new_with_allocator (NULL);
+}
+
+
+hipack_dict_t*
+hipack_dict_new_with_allocator (const hipack_allocator_t *allocator)
+{
+    hipack_dict_t *dict = hipack_allocator_alloc (allocator, NULL,
+                                                  sizeof (hipack_dict_t));
+    memset (dict, 0, sizeof (hipack_dict_t));
+    dict->allocator = allocator;
+    /* The entries array and the index are allocated on first insertion. */
+    return dict;
+}
+
+
+hipack_dict_t*
+hipack_dict_new_with_capacity (uint32_t capacity)
+{
+    hipack_dict_t *dict = hipack_dict_new_with_allocator (NULL);
+    hipack_dict_reserve (dict, capacity);
     return dict;
 }
 
 
+void
+hipack_dict_reserve (hipack_dict_t *dict, uint32_t capacity)
+{
+    assert (dict);
+    CHECK_NOT_FROZEN (dict);
+
+    if (!capacity)
+        return;
+
+    /* Check whether the unused entries are enough. */
+    if (dict->entries &&
+        capacity <= dict->count + (dict_capacity (dict->size) - dict->used))
+        return;
+
+    if (capacity < dict->count)
+        capacity = dict->count;
+
+    uint32_t size = dict->entries ? dict->size : HIPACK_DICT_DEFAULT_SIZE;
+    while (dict_capacity (size) < capacity) {
+        assert (size < (UINT32_C (1) << 31));
+        size <<= 1;
+    }
+    dict_resize (dict, size);
+}
+
+
+static void
+dict_free_entries (hipack_dict_t *dict)
+{
+    for (uint32_t i = 0; i < dict->used; i++) {
+        hipack_dict_node_t *node = &dict->entries[i];
+        if (is_live_node (node)) {
+            /* Keys of frozen dictionaries are part of the block. */
+            if (!dict->frozen)
+                node_free_key (dict, node);
+            hipack_value_free_with_allocator (dict->allocator, &node->value);
+        }
+    }
+    hipack_allocator_free (dict->allocator, dict->entries);
+}
+
+
 void
 hipack_dict_free (hipack_dict_t *dict)
 {
     if (dict) {
-        free_all_nodes (dict);
-        hipack_alloc_free (dict->nodes);
-        hipack_alloc_free (dict);
+        dict_free_entries (dict);
+        hipack_allocator_free (dict->allocator, dict);
     }
 }
 
 
+/*
+ * Adds a new entry for a key, or replaces the value of an existing entry,
+ * in which case the existing key is kept. Short keys are copied into the
+ * entry. Unless the KEY_BORROWED flag is passed, the key is freed when it
+ * is not used.
+ */
+static void
+dict_set (hipack_dict_t        *dict,
+          hipack_string_t      *key,
+          uint32_t              hash,
+          const hipack_value_t *value,
+          unsigned              flags)
+{
+    uint32_t slot;
+
+    if (dict->count) {
+        slot = dict_find_slot (dict, key->data, key->size, hash);
+        if (dict->index[slot]) {
+            hipack_dict_node_t *node = &dict->entries[dict->index[slot] - 1];
+            hipack_value_free_with_allocator (dict->allocator, &node->value);
+            memcpy (&node->value, value, sizeof (hipack_value_t));
+            if (!(flags & KEY_BORROWED))
+                hipack_string_free_with_allocator (dict->allocator, key);
+            return;
+        }
+    }
+
+    if (!dict->entries) {
+        dict_resize (dict, HIPACK_DICT_DEFAULT_SIZE);
+    } else if (dict->used == dict_capacity (dict->size)) {
+        /*
+         * Grow the table, unless there are enough removed entries that
+         * reclaiming their space leaves the table at most half full.
+         */
+        dict_resize (dict, (dict->count < dict_capacity (dict->size) / 2)
+                           ? dict->size : dict->size * 2);
+    }
+
+    slot = dict_slot (dict, hash);
+    while (dict->index[slot])
+        slot = (slot + 1) & (dict->size - 1);
+
+    hipack_dict_node_t *node = &dict->entries[dict->used];
+    memcpy (&node->value, value, sizeof (hipack_value_t));
+    node->hash = hash;
+    if (key->size <= HIPACK_DICT_INLINE_KEY_SIZE && !(flags & KEY_NOT_INLINE)) {
+        node->key_size = key->size;
+        memcpy (node->key_data, key->data, key->size);
+        if (!(flags & KEY_BORROWED))
+            hipack_string_free_with_allocator (dict->allocator, key);
+    } else {
+        node->key_size = KEY_EXTERNAL;
+        node->external.key = key;
+        node->external.borrowed = flags & KEY_BORROWED;
+    }
+
+    dict->index[slot] = ++dict->used;
+    dict->entries[dict->used].key_size = KEY_END;
+    dict->count++;
+}
+
+
 void
 hipack_dict_set (hipack_dict_t         *dict,
                  const hipack_string_t *key,
                  const hipack_value_t  *value)
 {
-    hipack_string_t *key_copy = hipack_string_copy (key);
-    hipack_dict_set_adopt_key (dict, &key_copy, value);
+    assert (dict);
+    assert (key);
+    assert (key->size);
+    assert (value);
+    CHECK_NOT_FROZEN (dict);
+
+    const uint32_t hash = hipack_string_hash (key);
+    if (key->size <= HIPACK_DICT_INLINE_KEY_SIZE) {
+        /* Copied into the entry, no need to make a copy first. */
+        dict_set (dict, (hipack_string_t*) key, hash, value, KEY_BORROWED);
+    } else {
+        dict_set (dict, hipack_string_copy_with_allocator (dict->allocator, key),
+                  hash, value, 0);
+    }
 }
 
 
@@ -136,39 +434,52 @@ void hipack_dict_set_adopt_key (hipack_dict_t        *dict,
     assert (dict);
     assert (key);
     assert (*key);
+    assert ((*key)->size);
     assert (value);
+    CHECK_NOT_FROZEN (dict);
 
-    uint32_t hash_val = hipack_string_hash (*key) % dict->size;
-    hipack_dict_node_t *node = dict->nodes[hash_val];
+    dict_set (dict, *key, hipack_string_hash (*key), value, 0);
+    *key = NULL;
+}
 
-    for (; node; node = node->next) {
-        if (hipack_string_equal (node->key, *key)) {
-            hipack_value_free (&node->value);
-            memcpy (&node->value, value, sizeof (hipack_value_t));
-            hipack_string_free (*key);
-            *key = NULL;
-            return;
-        }
-    }
 
-    node = make_node (*key, value);
-    *key = NULL;
+void
+hipack_dict_set_borrowed_key (hipack_dict_t         *dict,
+                              const hipack_string_t *key,
+                              const hipack_value_t  *value)
+{
+    assert (dict);
+    assert (key);
+    assert (key->size);
+    assert (value);
+    CHECK_NOT_FROZEN (dict);
 
-    if (dict->nodes[hash_val]) {
-        node->next = dict->nodes[hash_val];
-    }
-    dict->nodes[hash_val] = node;
+    /* The key is never freed by the dictionary. */
+    dict_set (dict, (hipack_string_t*) key, hipack_string_hash (key),
+              value, KEY_BORROWED);
+}
 
-    node->next_node = dict->first;
-    if (dict->first) {
-        dict->first->prev_node = node;
-    }
-    dict->first = node;
-    dict->count++;
 
-    if (dict->count > (dict->size * HIPACK_DICT_COUNT_TO_SIZE_RATIO)) {
-        rehash (dict);
+static hipack_value_t*
+dict_get (const hipack_dict_t *dict,
+          const uint8_t       *data,
+          uint32_t             size)
+{
+    if (!dict->count)
+        return NULL;
+
+    const uint32_t hash = hipack_lstring_hash ((const char*) data, size);
+
+    if (dict->buckets) {
+        /* Frozen, using perfect hashing: there is only one candidate. */
+        uint32_t entry = dict->index[frozen_find_slot (dict, hash)];
+        if (entry && node_has_key (&dict->entries[entry - 1], data, size, hash))
+            return &dict->entries[entry - 1].value;
+        return NULL;
     }
+
+    uint32_t entry = dict->index[dict_find_slot (dict, data, size, hash)];
+    return entry ? &dict->entries[entry - 1].value : NULL;
 }
 
 
@@ -178,29 +489,64 @@ hipack_dict_get (const hipack_dict_t   *dict,
 {
     assert (dict);
     assert (key);
+    return dict_get (dict, key->data, key->size);
+}
 
-    uint32_t hash_val = hipack_string_hash (key) % dict->size;
-    hipack_dict_node_t *node = dict->nodes[hash_val];
 
-    if (node) {
-        if (hipack_string_equal (key, node->key)) {
-            return &node->value;
-        }
+hipack_value_t*
+hipack_dict_get_lstring (const hipack_dict_t *dict,
+                         const char          *str,
+                         uint32_t             len)
+{
+    assert (dict);
+    assert (str || !len);
+    return dict_get (dict, (const uint8_t*) str, len);
+}
 
-        hipack_dict_node_t *last_node = node;
-        node = node->next;
-        while (node) {
-            if (hipack_string_equal (key, node->key)) {
-                last_node->next = node->next;
-                node->next = dict->nodes[hash_val];
-                dict->nodes[hash_val] = node;
-                return &node->value;
-            }
-            last_node = node;
-            node = node->next;
+
+static void
+dict_del (hipack_dict_t *dict,
+          const uint8_t *data,
+          uint32_t       size)
+{
+    CHECK_NOT_FROZEN (dict);
+
+    if (!dict->count)
+        return;
+
+    const uint32_t mask = dict->size - 1;
+    uint32_t slot = dict_find_slot (dict, data, size,
+                                    hipack_lstring_hash ((const char*) data, size));
+    uint32_t entry = dict->index[slot];
+    if (!entry)
+        return;
+
+    hipack_dict_node_t *node = &dict->entries[entry - 1];
+    node_free_key (dict, node);
+    hipack_value_free_with_allocator (dict->allocator, &node->value);
+    dict->count--;
+
+    if (entry == dict->used) {
+        /* The last entry can be reused right away. */
+        node->key_size = KEY_END;
+        dict->used--;
+    } else {
+        node->key_size = KEY_DELETED;
+    }
+
+    /*
+     * Shift back the slots following the removed one, until an empty slot
+     * is found, unless they would be moved before their home slot.
+     */
+    for (uint32_t next = (slot + 1) & mask; dict->index[next];
+         next = (next + 1) & mask) {
+        uint32_t home = dict_slot (dict, dict->entries[dict->index[next] - 1].hash);
+        if (((next - home) & mask) >= ((next - slot) & mask)) {
+            dict->index[slot] = dict->index[next];
+            slot = next;
         }
     }
-    return NULL;
+    dict->index[slot] = 0;
 }
 
 
@@ -210,24 +556,241 @@ hipack_dict_del (hipack_dict_t         *dict,
 {
     assert (dict);
     assert (key);
+    dict_del (dict, key->data, key->size);
+}
+
 
-    uint32_t hash_val = hipack_string_hash (key) % dict->size;
-    for (hipack_dict_node_t *node = dict->nodes[hash_val]; node; node = node->next) {
-        if (hipack_string_equal (node->key, key)) {
-            hipack_dict_node_t *prev_node = node->prev_node;
-            hipack_dict_node_t *next_node = node->next_node;
+void
+hipack_dict_del_lstring (hipack_dict_t *dict,
+                         const char    *str,
+                         uint32_t       len)
+{
+    assert (dict);
+    assert (str || !len);
+    dict_del (dict, (const uint8_t*) str, len);
+}
 
-            if (prev_node) prev_node->next_node = next_node;
-            else dict->first = next_node;
-            if (next_node) next_node->prev_node = prev_node;
 
-            dict->nodes[hash_val] = node->next;
-            dict->count--;
+/*
+ * Builds the perfect hash function for a frozen dictionary. The scratch
+ * area must have room for (buckets + 1 + 2 * count) elements.
+ */
+static bool
+frozen_build_index (hipack_dict_t *dict, uint32_t *scratch)
+{
+    const hipack_dict_node_t *entries = dict->entries;
+    const uint32_t count = dict->count;
+    const uint32_t bucket_mask = dict->buckets - 1;
+    uint32_t *displacements = dict->index + dict->size;
+    uint32_t *start = scratch;                 /* Buckets + 1 elements. */
+    uint32_t *order = start + dict->buckets + 1;  /* Entries, by bucket. */
+    uint32_t *slots = order + count;
+
+    /* Sort entries by bucket, and find the biggest bucket. */
+    memset (start, 0, (dict->buckets + 1) * sizeof (uint32_t));
+    for (uint32_t i = 0; i < count; i++)
+        start[(entries[i].hash & bucket_mask) + 1]++;
+
+    uint32_t max_bucket_size = 0;
+    for (uint32_t b = 0; b < dict->buckets; b++) {
+        if (start[b + 1] > max_bucket_size)
+            max_bucket_size = start[b + 1];
+        start[b + 1] += start[b];
+    }
 
-            free_node (node);
-            return;
+    /* There are never more buckets than entries, use slots as cursors. */
+    memcpy (slots, start, dict->buckets * sizeof (uint32_t));
+    for (uint32_t i = 0; i < count; i++)
+        order[slots[entries[i].hash & bucket_mask]++] = i;
+
+    /*
+     * Place the biggest buckets first, while there are many free slots.
+     * Buckets with a single key go last, each in the next free slot.
+     */
+    uint32_t free_slot = 0;
+    for (uint32_t size = max_bucket_size; size > 0; size--) {
+        for (uint32_t b = 0; b < dict->buckets; b++) {
+            if (start[b + 1] - start[b] != size)
+                continue;
+
+            const uint32_t *bucket = order + start[b];
+            if (size == 1) {
+                while (dict->index[free_slot])
+                    free_slot++;
+                displacements[b] = FROZEN_DIRECT_SLOT | free_slot;
+                dict->index[free_slot] = bucket[0] + 1;
+                continue;
+            }
+
+            uint32_t try = 0, d = 0;
+            for (; try < HIPACK_DICT_FREEZE_MAX_TRIES; try++) {
+                /* Pseudo-random values, which never have the flag set. */
+                d = (try * UINT32_C (0x9E3779B9)) & ~FROZEN_DIRECT_SLOT;
+
+                uint32_t k = 0;
+                for (; k < size; k++) {
+                    const uint32_t hash = entries[bucket[k]].hash;
+                    slots[k] = frozen_slot (dict, hash, d);
+                    if (dict->index[slots[k]])
+                        break;
+
+                    uint32_t j = 0;
+                    while (j < k && slots[j] != slots[k])
+                        j++;
+                    if (j < k) {
+                        /* Keys with the same hash can never be separated. */
+                        if (entries[bucket[j]].hash == hash)
+                            return false;
+                        break;
+                    }
+                }
+                if (k == size)
+                    break;
+            }
+            if (try == HIPACK_DICT_FREEZE_MAX_TRIES)
+                return false;
+
+            displacements[b] = d;
+            for (uint32_t k = 0; k < size; k++)
+                dict->index[slots[k]] = bucket[k] + 1;
+        }
+    }
+    return true;
+}
+
+
+static void
+freeze_value (hipack_value_t *value)
+{
+    switch (hipack_value_type (value)) {
+        case HIPACK_DICT:
+            hipack_dict_freeze (value->v_dict);
+            break;
+        case HIPACK_LIST:
+            for (uint32_t i = 0; i < value->v_list->size; i++)
+                freeze_value (&value->v_list->data[i]);
+            break;
+        default:
+            break;
+    }
+}
+
+
+void
+hipack_dict_freeze (hipack_dict_t *dict)
+{
+    assert (dict);
+
+    if (dict->frozen)
+        return;
+
+    size_t keys_size = 0;
+    for (uint32_t i = 0; i < dict->used; i++) {
+        hipack_dict_node_t *node = &dict->entries[i];
+        if (is_live_node (node)) {
+            freeze_value (&node->value);
+            if (node->key_size == KEY_EXTERNAL && !node->external.borrowed)
+                keys_size += (sizeof (hipack_string_t) +
+                              node->external.key->size + 3) & ~3;
+        }
+    }
+
+    dict->frozen = true;
+    if (!dict->count) {
+        hipack_allocator_free (dict->allocator, dict->entries);
+        dict->entries = NULL;
+        dict->index = NULL;
+        dict->used = dict->size = dict->shift = 0;
+        return;
+    }
+
+    /*
+     * Size the index to allow using the same kind of index as mutable
+     * dictionaries, in case that a perfect hash function is not found.
+     */
+    const uint32_t size = (dict->count > 1) ? round_pow2 (dict->count) : 2;
+    const uint32_t buckets = round_pow2 (dict->count / FROZEN_BUCKET_KEYS);
+    uint32_t fallback_size = HIPACK_DICT_DEFAULT_SIZE;
+    while (dict_capacity (fallback_size) < dict->count)
+        fallback_size <<= 1;
+    const uint32_t index_size = (size + buckets > fallback_size)
+        ? size + buckets : fallback_size;
+
+    hipack_dict_node_t *entries =
+        hipack_allocator_alloc_array_extra (dict->allocator, NULL,
+                                            dict->count + 1,
+                                            sizeof (hipack_dict_node_t),
+                                            index_size * sizeof (uint32_t) +
+                                            keys_size);
+    uint32_t *index = (uint32_t*) (entries + dict->count + 1);
+    uint8_t *keys = (uint8_t*) (index + index_size);
+
+    /* Copy the entries, moving the keys into the block. */
+    uint32_t used = 0;
+    for (uint32_t i = 0; i < dict->used; i++) {
+        hipack_dict_node_t *node = &dict->entries[i];
+        if (!is_live_node (node))
+            continue;
+
+        entries[used] = *node;
+        if (node->key_size == KEY_EXTERNAL && !node->external.borrowed) {
+            hipack_string_t *key = (hipack_string_t*) keys;
+            key->size = node->external.key->size;
+            memcpy (key->data, node->external.key->data, key->size);
+            keys += (sizeof (hipack_string_t) + key->size + 3) & ~3;
+            node_free_key (dict, node);
+            entries[used].external.key = key;
         }
+        used++;
+    }
+    assert (used == dict->count);
+    entries[used].key_size = KEY_END;
+
+    hipack_allocator_free (dict->allocator, dict->entries);
+    dict->entries = entries;
+    dict->index = index;
+    dict->used = used;
+
+    uint32_t *scratch =
+        hipack_allocator_alloc_array_extra (dict->allocator, NULL,
+                                            buckets + 1 + 2 * used,
+                                            sizeof (uint32_t), 0);
+    memset (index, 0, index_size * sizeof (uint32_t));
+    dict->size = size;
+    dict->shift = 32 - __builtin_ctz (size);
+    dict->buckets = buckets;
+    bool found = frozen_build_index (dict, scratch);
+    hipack_allocator_free (dict->allocator, scratch);
+
+    if (!found) {
+        memset (index, 0, index_size * sizeof (uint32_t));
+        dict->buckets = 0;
+        dict->size = fallback_size;
+        dict->shift = 32 - __builtin_ctz (fallback_size);
+        for (uint32_t i = 0; i < used; i++) {
+            uint32_t slot = dict_slot (dict, entries[i].hash);
+            while (index[slot])
+                slot = (slot + 1) & (fallback_size - 1);
+            index[slot] = i + 1;
+        }
+    }
+}
+
+
+/* Skips removed entries, returns NULL at the end of the entries array. */
+static inline hipack_value_t*
+live_node (hipack_dict_node_t     *node,
+           const hipack_string_t **key)
+{
+    while (node->key_size == KEY_DELETED)
+        node++;
+
+    if (node->key_size == KEY_END) {
+        *key = NULL;
+        return NULL;
     }
+    *key = node_key (node);
+    return &node->value;
 }
 
 
@@ -238,13 +801,11 @@ hipack_dict_first (const hipack_dict_t    *dict,
     assert (dict);
     assert (key);
 
-    if (dict->first) {
-        *key = dict->first->key;
-        return (hipack_value_t*) dict->first;
-    } else {
+    if (!dict->count) {
         *key = NULL;
         return NULL;
     }
+    return live_node (dict->entries, key);
 }
 
 
@@ -255,12 +816,52 @@ hipack_dict_next (hipack_value_t         *value,
     assert (value);
     assert (key);
 
-    hipack_dict_node_t *node = (hipack_dict_node_t*) value;
-    if (node->next_node) {
-        *key = node->next_node->key;
-        return (hipack_value_t*) node->next_node;
-    } else {
-        *key = NULL;
-        return NULL;
+    /* The value is the first member of the entry. */
+    return live_node (((hipack_dict_node_t*) value) + 1, key);
+}
+
+
+hipack_intern_t*
+hipack_intern_new (void)
+{
+    return hipack_alloc_bzero (sizeof (hipack_intern_t));
+}
+
+
+void
+hipack_intern_free (hipack_intern_t *pool)
+{
+    if (pool) {
+        dict_free_entries (&pool->dict);
+        hipack_alloc_free (pool);
+    }
+}
+
+
+/* Pools are dictionaries in which the only relevant part are the keys. */
+const hipack_string_t*
+hipack_intern (hipack_intern_t       *pool,
+               const hipack_string_t *str)
+{
+    assert (pool);
+    assert (str);
+    assert (str->size);
+
+    hipack_dict_t *dict = &pool->dict;
+    const uint32_t hash = hipack_string_hash (str);
+
+    if (dict->count) {
+        uint32_t entry = dict->index[dict_find_slot (dict, str->data, str->size, hash)];
+        if (entry)
+            return node_key (&dict->entries[entry - 1]);
     }
+
+    static const hipack_value_t present = {
+        .v_bool = true,
+        .tag    = HIPACK_BOOL,
+    };
+    /* Keys are not stored inline, their address must not change. */
+    hipack_string_t *copy = hipack_string_copy (str);
+    dict_set (dict, copy, hash, &present, KEY_NOT_INLINE);
+    return copy;
 }
@@ -0,0 +1,79 @@
+/*
+ * hipack-file.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+#include "hipack.h"
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+
+static int
+fd_read (void *data, uint8_t *buffer, size_t size)
+{
+    const int fd = *((const int*) data);
+    for (;;) {
+        ssize_t nread = read (fd, buffer, size);
+        if (nread > 0)
+            return (int) nread;
+        if (nread == 0)
+            return HIPACK_IO_EOF;
+        if (errno != EINTR)
+            return HIPACK_IO_ERROR;
+    }
+}
+
+
+hipack_dict_t*
+hipack_read_file (const char      *path,
+                  hipack_reader_t *reader)
+{
+    assert (path);
+    assert (reader);
+
+    int fd = open (path, O_RDONLY);
+    if (fd == -1) {
+        memset (reader, 0x00, sizeof (hipack_reader_t));
+        reader->error = HIPACK_READ_ERROR;
+        return NULL;
+    }
+
+    hipack_dict_t *result;
+    struct stat st;
+
+    /*
+     * Regular files are mapped into memory and parsed in place. Anything
+     * else (pipes, sockets, character devices...) or files which cannot
+     * be mapped are read in blocks.
+     */
+    if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode) &&
+        st.st_size > 0 && (uintmax_t) st.st_size <= SIZE_MAX) {
+        const size_t length = (size_t) st.st_size;
+        void *data = mmap (NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            close (fd);
+            posix_madvise (data, length, POSIX_MADV_SEQUENTIAL);
+            result = hipack_read_buffer (data, length, reader);
+            munmap (data, length);
+            return result;
+        }
+    }
+
+    reader->read      = fd_read;
+    reader->read_data = &fd;
+    result = hipack_read (reader);
+
+    /* Keep errno from the read error, if any, for the caller to inspect. */
+    int saved_errno = errno;
+    close (fd);
+    errno = saved_errno;
+
+    return result;
+}
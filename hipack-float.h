@@ -0,0 +1,36 @@
+/*
+ * hipack-float.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef HIPACK_FLOAT_H
+#define HIPACK_FLOAT_H
+
+/*
+ * Conversion of decimal floating point numbers to double, used by the
+ * parser. The input is an optional sign, digits with at most one dot, and
+ * an optional exponent ("e" or "E", optional sign, and digits). Unlike
+ * strtod(), the result does not depend on the current locale, and neither
+ * hexadecimal numbers nor "inf" and "nan" are accepted.
+ *
+ * Results are correctly rounded: most numbers are converted using exact
+ * floating point arithmetic (Clinger's fast path) or the Eisel-Lemire
+ * algorithm, and the few remaining ones (more than 19 significant digits
+ * which are not enough to decide the rounding, values close to halfway
+ * between two doubles, overflow and underflow) are handed over to strtod().
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Converts the "length" bytes at "str", which must be followed by a NUL
+ * byte. Returns false if the text is not a valid number.
+ */
+extern bool hipack_float_parse (const char *str,
+                                uint32_t    length,
+                                double     *value);
+
+#endif /* !HIPACK_FLOAT_H */
@@ -14,13 +14,21 @@ static hipack_list_t s_empty_list = { .size = 0 };
 
 hipack_list_t*
 hipack_list_new (uint32_t size)
+{
+    return hipack_list_new_with_allocator (NULL, size);
+}
+
+
+hipack_list_t*
+hipack_list_new_with_allocator (const hipack_allocator_t *allocator,
+                                uint32_t                  size)
 {
     hipack_list_t *list;
 
     if (size) {
-        list = hipack_alloc_array_extra (NULL, size,
-                                         sizeof (hipack_value_t),
-                                         sizeof (hipack_list_t));
+        list = hipack_allocator_alloc_array_extra (allocator, NULL, size,
+                                                   sizeof (hipack_value_t),
+                                                   sizeof (hipack_list_t));
         list->size = size;
     } else {
         list = &s_empty_list;
@@ -31,11 +39,19 @@ hipack_list_new (uint32_t size)
 
 void
 hipack_list_free (hipack_list_t *list)
+{
+    hipack_list_free_with_allocator (NULL, list);
+}
+
+
+void
+hipack_list_free_with_allocator (const hipack_allocator_t *allocator,
+                                 hipack_list_t            *list)
 {
     if (list && list != &s_empty_list) {
         for (uint32_t i = 0; i < list->size; i++)
-            hipack_value_free (&list->data[i]);
-        hipack_alloc_free (list);
+            hipack_value_free_with_allocator (allocator, &list->data[i]);
+        hipack_allocator_free (allocator, list);
     }
 }
 
@@ -16,10 +16,10 @@ hipack_value_equal (const hipack_value_t *a,
     assert (a);
     assert (b);
 
-    if (a->type != b->type)
+    if (hipack_value_type (a) != hipack_value_type (b))
         return false;
 
-    switch (a->type) {
+    switch (hipack_value_type (a)) {
         case HIPACK_INTEGER:
             return a->v_integer == b->v_integer;
         case HIPACK_BOOL:
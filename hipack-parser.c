@@ -6,6 +6,8 @@
  */
 
 #include "hipack.h"
+#include "hipack-scan.h"
+#include "hipack-float.h"
 #include <assert.h>
 #include <string.h>
 #include <stdbool.h>
@@ -26,13 +28,36 @@ enum status {
 typedef enum status status_t;
 
 
+#ifndef HIPACK_READ_BUFFER_SIZE
+#define HIPACK_READ_BUFFER_SIZE 4096
+#endif /* !HIPACK_READ_BUFFER_SIZE */
+
+/*
+ * Dictionaries are created with room for as many elements as the previous
+ * dictionary found in the same list or dictionary, up to this amount.
+ */
+#ifndef HIPACK_DICT_SIZE_HINT_MAX
+#define HIPACK_DICT_SIZE_HINT_MAX 1024
+#endif /* !HIPACK_DICT_SIZE_HINT_MAX */
+
+
 struct parser {
     int       (*getchar) (void*);
     void       *getchar_data;
+    int       (*read) (void*, uint8_t*, size_t);
+    void       *read_data;
+    uint8_t    *buffer;
+    const uint8_t *pos;
+    const uint8_t *end;
     int         look;
     unsigned    line;
     unsigned    column;
     const char *error;
+    const hipack_allocator_t *allocator;
+    uint32_t    dict_size_hint;
+    hipack_intern_t *intern;
+    hipack_string_t *key_buffer;
+    uint32_t    key_buffer_alloc;
 };
 
 #define P struct parser* p
@@ -44,7 +69,15 @@ struct parser {
 #define DUMMY ) /* Makes autoindentation work. */
 #undef DUMMY
 
-#define DUMMY_VALUE ((hipack_value_t) { .type = HIPACK_BOOL, .annot = NULL })
+#define DUMMY_VALUE ((hipack_value_t) { .tag = HIPACK_BOOL })
+
+
+/* Changes the type of a value, keeping its annotations. */
+static inline void
+set_type (hipack_value_t *value, hipack_type_t type)
+{
+    value->tag = (value->tag & ~HIPACK_VALUE_TYPE_MASK) | type;
+}
 
 
 static hipack_value_t parse_value (P, S);
@@ -184,28 +217,85 @@ xdigit_to_int (int xdigit)
 }
 
 
+/*
+ * Refills the input buffer. Returns HIPACK_IO_EOF or HIPACK_IO_ERROR when
+ * no more input is available, or zero if the buffer contains more input.
+ */
+static int
+fill_buffer (P, S)
+{
+    int ret;
+
+    if (p->read) {
+        ret = (*p->read) (p->read_data, p->buffer, HIPACK_READ_BUFFER_SIZE);
+        if (ret > 0) {
+            assert (ret <= HIPACK_READ_BUFFER_SIZE);
+            p->pos = p->buffer;
+            p->end = p->buffer + ret;
+            return 0;
+        }
+        if (ret == 0) {
+            ret = HIPACK_IO_EOF;
+        }
+    } else if (p->getchar) {
+        /* Compatibility path: fill the buffer one character at a time. */
+        ret = (*p->getchar) (p->getchar_data);
+        if (ret >= 0) {
+            p->buffer[0] = ret;
+            p->pos = p->buffer;
+            p->end = p->buffer + 1;
+            return 0;
+        }
+    } else {
+        /* Parsing from a memory buffer, which has been consumed. */
+        ret = HIPACK_IO_EOF;
+    }
+
+    if (ret == HIPACK_IO_ERROR) {
+        *status = kStatusIoError;
+    } else {
+        assert (ret == HIPACK_IO_EOF);
+    }
+    return ret;
+}
+
+
 static inline int
 nextchar_raw (P, S)
 {
-    int ch = (*p->getchar) (p->getchar_data);
-    switch (ch) {
-        case HIPACK_IO_ERROR:
-            *status = kStatusIoError;
-            /* fall-through */
-        case HIPACK_IO_EOF:
-            break;
+    if (p->pos == p->end) {
+        int ret = fill_buffer (p, status);
+        if (ret != 0)
+            return ret;
+    }
 
-        case '\n':
-            p->column = 0;
-            p->line++;
-            /* fall-through */
-        default:
-            p->column++;
+    int ch = *p->pos++;
+    if (ch == '\n') {
+        p->column = 0;
+        p->line++;
     }
+    p->column++;
     return ch;
 }
 
 
+/*
+ * Updates the line and column numbers after skipping over the characters
+ * in the [start, end) range of the input buffer.
+ */
+static inline void
+advance_position (P, const uint8_t *start, const uint8_t *end)
+{
+    const uint8_t *newline;
+    while ((newline = memchr (start, '\n', end - start)) != NULL) {
+        p->line++;
+        p->column = 1;
+        start = newline + 1;
+    }
+    p->column += end - start;
+}
+
+
 static inline void
 nextchar (P, S)
 {
@@ -227,8 +317,13 @@ error:
 static inline void
 skipwhite (P, S)
 {
-    while (p->look != HIPACK_IO_EOF && is_hipack_whitespace (p->look))
+    while (p->look != HIPACK_IO_EOF && is_hipack_whitespace (p->look)) {
+        /* Skip the rest of the whitespace available in the input buffer. */
+        const uint8_t *stop = hipack_scan_whitespace (p->pos, p->end);
+        advance_position (p, p->pos, stop);
+        p->pos = stop;
         nextchar (p, status);
+    }
 }
 
 
@@ -265,26 +360,44 @@ error:
 #endif /* !HIPACK_LIST_POW_SIZE */
 
 
+/*
+ * Calculates how many elements to allocate when "size" elements do not fit
+ * in the "alloc" elements currently allocated. Small sizes are rounded up
+ * to a multiple of "chunk", and from "pow" elements onwards the allocation
+ * grows geometrically, which keeps appending elements amortized O(1).
+ */
+static inline uint32_t
+grow_size (uint32_t alloc, uint32_t size, uint32_t chunk, uint32_t pow)
+{
+    assert (size > alloc);
+
+    uint32_t new_size;
+    if (size < pow) {
+        new_size = chunk * ((size / chunk) + 1);
+    } else {
+        new_size = (alloc > UINT32_MAX - alloc / 2) ? UINT32_MAX
+                                                    : alloc + alloc / 2;
+    }
+    return (new_size < size) ? size : new_size;
+}
+
+
 static hipack_string_t*
-string_resize (hipack_string_t *hstr, uint32_t *alloc, uint32_t size)
+string_resize (P, hipack_string_t *hstr, uint32_t *alloc, uint32_t size)
 {
-    /* TODO: Use HIPACK_STRING_POW_SIZE. */
     if (size) {
-        uint32_t new_size = HIPACK_STRING_CHUNK_SIZE *
-            ((size / HIPACK_STRING_CHUNK_SIZE) + 1);
-        if (new_size < size) {
-            new_size = size;
-        }
-        if (new_size != *alloc) {
-            *alloc = new_size;
-            new_size = sizeof (hipack_string_t) + new_size * sizeof (uint8_t);
-            hstr = hipack_alloc_array_extra (hstr, new_size,
-                                             sizeof (uint8_t),
-                                             sizeof (hipack_string_t));
+        if (size > *alloc) {
+            *alloc = grow_size (*alloc, size,
+                                HIPACK_STRING_CHUNK_SIZE,
+                                HIPACK_STRING_POW_SIZE);
+            hstr = hipack_allocator_alloc_array_extra (p->allocator, hstr,
+                                                       *alloc,
+                                                       sizeof (uint8_t),
+                                                       sizeof (hipack_string_t));
         }
         hstr->size = size;
     } else {
-        hipack_alloc_free (hstr);
+        hipack_allocator_free (p->allocator, hstr);
         hstr = NULL;
         *alloc = 0;
     }
@@ -292,25 +405,55 @@ string_resize (hipack_string_t *hstr, uint32_t *alloc, uint32_t size)
 }
 
 
+static hipack_string_t*
+string_append (P,
+               hipack_string_t *hstr,
+               uint32_t        *alloc,
+               const uint8_t   *data,
+               uint32_t         length)
+{
+    assert (length > 0);
+    uint32_t size = hstr ? hstr->size : 0;
+    hstr = string_resize (p, hstr, alloc, size + length);
+    memcpy (hstr->data + size, data, length);
+    return hstr;
+}
+
+
+/*
+ * Releases the unused space at the end of a string once it is complete.
+ * Only strings which have grown geometrically waste enough to be worth it.
+ */
+static hipack_string_t*
+string_shrink (P, hipack_string_t *hstr, uint32_t *alloc)
+{
+    if (hstr && *alloc - hstr->size >= HIPACK_STRING_CHUNK_SIZE) {
+        *alloc = hstr->size;
+        hstr = hipack_allocator_alloc_array_extra (p->allocator, hstr,
+                                                   *alloc,
+                                                   sizeof (uint8_t),
+                                                   sizeof (hipack_string_t));
+    }
+    return hstr;
+}
+
+
 static hipack_list_t*
-list_resize (hipack_list_t *list, uint32_t *alloc, uint32_t size)
+list_resize (P, hipack_list_t *list, uint32_t *alloc, uint32_t size)
 {
-    /* TODO: Use HIPACK_LIST_POW_SIZE. */
     if (size) {
-        uint32_t new_size = HIPACK_LIST_CHUNK_SIZE *
-            ((size / HIPACK_LIST_CHUNK_SIZE) + 1);
-        if (new_size < size) {
-            new_size = size;
-        }
-        if (new_size != *alloc) {
-            *alloc = new_size;
-            list = hipack_alloc_array_extra (list, new_size,
-                                             sizeof (hipack_value_t),
-                                             sizeof (hipack_list_t));
+        if (size > *alloc) {
+            *alloc = grow_size (*alloc, size,
+                                HIPACK_LIST_CHUNK_SIZE,
+                                HIPACK_LIST_POW_SIZE);
+            list = hipack_allocator_alloc_array_extra (p->allocator, list,
+                                                       *alloc,
+                                                       sizeof (hipack_value_t),
+                                                       sizeof (hipack_list_t));
         }
         list->size = size;
     } else {
-        hipack_alloc_free (list);
+        hipack_allocator_free (p->allocator, list);
         list = NULL;
         *alloc = 0;
     }
@@ -318,94 +461,217 @@ list_resize (hipack_list_t *list, uint32_t *alloc, uint32_t size)
 }
 
 
-/* On empty (missing) keys, NULL is returned. */
+/* Same as string_shrink(), for lists. */
+static hipack_list_t*
+list_shrink (P, hipack_list_t *list, uint32_t *alloc)
+{
+    if (list && *alloc - list->size >= HIPACK_LIST_CHUNK_SIZE) {
+        *alloc = list->size;
+        list = hipack_allocator_alloc_array_extra (p->allocator, list,
+                                                   *alloc,
+                                                   sizeof (hipack_value_t),
+                                                   sizeof (hipack_list_t));
+    }
+    return list;
+}
+
+
+/*
+ * Keys are read into a buffer which is reused, and the returned key is only
+ * valid until the next one is parsed: use keep_key() to obtain one that can
+ * be used after parsing a value. On empty (missing) keys, NULL is returned.
+ */
 static hipack_string_t*
 parse_key (P, S)
 {
-    hipack_string_t *hstr = NULL;
-    uint32_t alloc_size = 0;
-    uint32_t size = 0;
+    hipack_string_t *hstr = p->key_buffer;
+    uint32_t alloc_size = p->key_buffer_alloc;
+
+    if (hstr)
+        hstr->size = 0;
 
     while (p->look != HIPACK_IO_EOF && is_hipack_key_character (p->look)) {
-        hstr = string_resize (hstr, &alloc_size, size + 1);
-        hstr->data[size++] = p->look;
+        /*
+         * The lookahead character is the last one consumed from the input
+         * buffer: copy it along with the rest of key characters available
+         * in the buffer. Comments are handled by nextchar().
+         */
+        const uint8_t *run = p->pos - 1;
+        const uint8_t *stop = hipack_scan_key (p->pos, p->end);
+
+        hstr = string_append (p, hstr, &alloc_size, run, stop - run);
+        p->column += stop - p->pos;
+        p->pos = stop;
         nextchar (p, CHECK_OK);
     }
 
-    return hstr;
+    p->key_buffer = hstr;
+    p->key_buffer_alloc = alloc_size;
+    return (hstr && hstr->size) ? hstr : NULL;
 
 error:
-    hipack_string_free (hstr);
+    p->key_buffer = hstr;
+    p->key_buffer_alloc = alloc_size;
     return NULL;
 }
 
 
+/* Space for a key short enough to be stored inline in dictionaries. */
+typedef uint32_t key_storage_t[(sizeof (hipack_string_t) +
+                                HIPACK_DICT_INLINE_KEY_SIZE + 3) / 4];
+
+/*
+ * Obtains a copy of a key returned by parse_key(). Keys are obtained from
+ * the intern pool if there is one, short keys are copied into "storage",
+ * and otherwise a new string is allocated. Use set_key() and free_key() to
+ * handle keys returned by this function.
+ */
+static inline hipack_string_t*
+keep_key (P, const hipack_string_t *key, key_storage_t storage)
+{
+    if (p->intern)
+        return (hipack_string_t*) hipack_intern (p->intern, key);
+
+    if (key->size <= HIPACK_DICT_INLINE_KEY_SIZE) {
+        hipack_string_t *copy = (hipack_string_t*) storage;
+        copy->size = key->size;
+        memcpy (copy->data, key->data, key->size);
+        return copy;
+    }
+    return hipack_string_copy_with_allocator (p->allocator, key);
+}
+
+
+static inline bool
+is_owned_key (P, const hipack_string_t *key)
+{
+    return key && !p->intern && key->size > HIPACK_DICT_INLINE_KEY_SIZE;
+}
+
+
+static inline void
+set_key (P, hipack_dict_t *dict, hipack_string_t **key,
+         const hipack_value_t *value)
+{
+    if (is_owned_key (p, *key)) {
+        hipack_dict_set_adopt_key (dict, key, value);
+    } else {
+        /* Short keys are copied into the entries. */
+        hipack_dict_set_borrowed_key (dict, *key, value);
+        *key = NULL;
+    }
+}
+
+
+static inline void
+free_key (P, hipack_string_t *key)
+{
+    if (is_owned_key (p, key))
+        hipack_string_free_with_allocator (p->allocator, key);
+}
+
+
 static void
 parse_string (P, hipack_value_t *result, S)
 {
     hipack_string_t *hstr = NULL;
     uint32_t alloc_size = 0;
-    uint32_t size = 0;
 
-    matchchar (p, '"', NULL, CHECK_OK);
+    /* Not using matchchar(), which would skip a leading '#' as a comment. */
+    assert (p->look == '"');
+    p->look = nextchar_raw (p, CHECK_OK);
 
     while (p->look != '"' && p->look != HIPACK_IO_EOF) {
+        if (p->look != '\\') {
+            /*
+             * Copy the run of characters which do not need unescaping
+             * available in the input buffer, starting at the lookahead
+             * character, with a single operation.
+             */
+            const uint8_t *run = p->pos - 1;
+            const uint8_t *stop = hipack_scan_string (p->pos, p->end);
+
+            hstr = string_append (p, hstr, &alloc_size, run, stop - run);
+            advance_position (p, p->pos, stop);
+            p->pos = stop;
+            p->look = nextchar_raw (p, CHECK_OK);
+            continue;
+        }
+
         /* Handle escapes. */
-        if (p->look == '\\') {
-            int extra;
+        int extra;
 
-            p->look = nextchar_raw (p, CHECK_OK);
-            switch (p->look) {
-                case '"' : p->look = '"' ; break;
-                case 'n' : p->look = '\n'; break;
-                case 'r' : p->look = '\r'; break;
-                case 't' : p->look = '\t'; break;
-                case '\\': p->look = '\\'; break;
-                default:
-                    /* Hex number. */
-                    extra = nextchar_raw (p, CHECK_OK);
-                    if (!isxdigit (extra) || !isxdigit (p->look)) {
-                        p->error = "invalid escape sequence";
-                        *status = kStatusError;
-                        goto error;
-                    }
-                    p->look = (xdigit_to_int (p->look) * 16) +
-                        xdigit_to_int (extra);
-                    break;
-            }
+        p->look = nextchar_raw (p, CHECK_OK);
+        switch (p->look) {
+            case '"' : p->look = '"' ; break;
+            case 'n' : p->look = '\n'; break;
+            case 'r' : p->look = '\r'; break;
+            case 't' : p->look = '\t'; break;
+            case '\\': p->look = '\\'; break;
+            default:
+                /* Hex number. */
+                extra = nextchar_raw (p, CHECK_OK);
+                if (!isxdigit (extra) || !isxdigit (p->look)) {
+                    p->error = "invalid escape sequence";
+                    *status = kStatusError;
+                    goto error;
+                }
+                p->look = (xdigit_to_int (p->look) * 16) +
+                    xdigit_to_int (extra);
+                break;
         }
 
-        hstr = string_resize (hstr, &alloc_size, size + 1);
-        hstr->data[size++] = p->look;
+        uint8_t ch = p->look;
+        hstr = string_append (p, hstr, &alloc_size, &ch, 1);
 
         /* Read next character from the string. */
         p->look = nextchar_raw (p, CHECK_OK);
     }
 
     matchchar (p, '"', "unterminated string value", CHECK_OK);
-    result->type = HIPACK_STRING;
-    result->v_string = hstr ? hstr : hipack_string_new_from_lstring ("", 0);
+    hstr = string_shrink (p, hstr, &alloc_size);
+    set_type (result, HIPACK_STRING);
+    result->v_string = hstr ? hstr
+        : hipack_string_new_from_lstring_with_allocator (p->allocator, "", 0);
     return;
 
 error:
-    hipack_string_free (hstr);
+    hipack_string_free_with_allocator (p->allocator, hstr);
     return;
 }
 
 
+/*
+ * Siblings often have the same structure (e.g. a list of records), so the
+ * size of a dictionary is used as hint for the next one.
+ */
+static inline void
+update_dict_size_hint (const hipack_value_t *value, uint32_t *hint)
+{
+    if (hipack_value_is_dict (value)) {
+        uint32_t size = hipack_dict_size (value->v_dict);
+        *hint = (size < HIPACK_DICT_SIZE_HINT_MAX) ? size
+                                                   : HIPACK_DICT_SIZE_HINT_MAX;
+    }
+}
+
+
 static void
 parse_list (P, hipack_value_t *result, S)
 {
     hipack_list_t *list = NULL;
     uint32_t alloc_size = 0;
     uint32_t size = 0;
+    uint32_t dict_size_hint = 0;
 
     matchchar (p, '[', NULL, CHECK_OK);
     skipwhite (p, CHECK_OK);
 
     while (p->look != ']') {
+        p->dict_size_hint = dict_size_hint;
         hipack_value_t value = parse_value (p, CHECK_OK);
-        list = list_resize (list, &alloc_size, size + 1);
+        update_dict_size_hint (&value, &dict_size_hint);
+        list = list_resize (p, list, &alloc_size, size + 1);
         list->data[size++] = value;
 
         bool got_whitespace = is_hipack_whitespace (p->look);
@@ -421,12 +687,14 @@ parse_list (P, hipack_value_t *result, S)
     }
 
     matchchar (p, ']', "unterminated list value", CHECK_OK);
-    result->type = HIPACK_LIST;
-    result->v_list = list ? list : hipack_list_new (0);
+    list = list_shrink (p, list, &alloc_size);
+    set_type (result, HIPACK_LIST);
+    result->v_list = list ? list
+        : hipack_list_new_with_allocator (p->allocator, 0);
     return;
 
 error:
-    hipack_list_free (list);
+    hipack_list_free_with_allocator (p->allocator, list);
     return;
 }
 
@@ -434,12 +702,13 @@ error:
 static void
 parse_dict (P, hipack_value_t *result, S)
 {
-    hipack_dict_t *dict = hipack_dict_new ();
+    hipack_dict_t *dict = hipack_dict_new_with_allocator (p->allocator);
+    hipack_dict_reserve (dict, p->dict_size_hint);
     matchchar (p, '{', NULL, CHECK_OK);
     skipwhite (p, CHECK_OK);
     parse_keyval_items (p, dict, '}', CHECK_OK);
     matchchar (p, '}', "unterminated dict value", CHECK_OK);
-    result->type = HIPACK_DICT;
+    set_type (result, HIPACK_DICT);
     result->v_dict = dict;
     return;
 
@@ -452,7 +721,7 @@ error:
 static void
 parse_bool (P, hipack_value_t *result, S)
 {
-    result->type = HIPACK_BOOL;
+    set_type (result, HIPACK_BOOL);
     if (p->look == 'T' || p->look == 't') {
         nextchar (p, CHECK_OK);
         matchchar (p, 'r', NULL, CHECK_OK);
@@ -474,44 +743,91 @@ error:
 }
 
 
+/*
+ * Text of a floating point number, for hipack_float_parse(). It is copied
+ * into a buffer in the stack, and only numbers which do not fit there use
+ * the heap.
+ */
+#ifndef HIPACK_NUMBER_BUFFER_SIZE
+#define HIPACK_NUMBER_BUFFER_SIZE 64
+#endif /* !HIPACK_NUMBER_BUFFER_SIZE */
+
+struct number_text {
+    uint8_t          buffer[HIPACK_NUMBER_BUFFER_SIZE];
+    uint32_t         size;
+    uint32_t         alloc;
+    hipack_string_t *hstr;
+};
+
+
+static inline void
+number_text_append (P, struct number_text *text, uint8_t ch)
+{
+    if (!text->hstr) {
+        if (text->size < sizeof (text->buffer)) {
+            text->buffer[text->size++] = ch;
+            return;
+        }
+        text->hstr = string_append (p, NULL, &text->alloc,
+                                    text->buffer, text->size);
+    }
+    text->hstr = string_append (p, text->hstr, &text->alloc, &ch, 1);
+    text->size++;
+}
+
+
 static void
 parse_number (P, hipack_value_t *result, S)
 {
-    hipack_string_t *hstr = NULL;
-    uint32_t alloc_size = 0;
-    uint32_t size = 0;
+    /* Not using an initializer, which would clear the whole buffer. */
+    struct number_text text;
+    text.size = text.alloc = 0;
+    text.hstr = NULL;
 
 #define SAVE_LOOK( ) \
-    hstr = string_resize (hstr, &alloc_size, size + 1); \
-    hstr->data[size++] = p->look
+    number_text_append (p, &text, p->look)
 
     /* Optional sign. */
+    bool negative = false;
     if (p->look == '-' || p->look == '+') {
+        negative = (p->look == '-');
         SAVE_LOOK ();
         nextchar (p, CHECK_OK);
     }
 
     /* Octal/hexadecimal numbers. */
-    bool is_octal = false;
-    bool is_hex = false;
+    unsigned base = 10;
+    uint32_t digits = 0;
     if (p->look == '0') {
         SAVE_LOOK ();
         nextchar (p, CHECK_OK);
         if (p->look == 'x' || p->look == 'X') {
             SAVE_LOOK ();
             nextchar (p, CHECK_OK);
-            is_hex = true;
-        } else if (is_octal_nonzero_digit (p->look)) {
-            is_octal = true;
+            base = 16;
+        } else {
+            if (is_octal_nonzero_digit (p->look))
+                base = 8;
+            digits++;
         }
     }
 
-    /* Read the rest of the number. */
+    /*
+     * Read the rest of the number. Digits are accumulated as an integer
+     * while scanning, which is discarded if the number turns out to be a
+     * floating point one. Once the magnitude is out of range it is kept at
+     * "limit + 1" instead of accumulating more digits, so it cannot overflow.
+     */
+    const uint64_t limit = negative ? (uint64_t) INT64_MAX + 1 : INT64_MAX;
+    const uint64_t cutoff = limit / base;
+    const unsigned cutoff_digit = limit % base;
+    uint64_t magnitude = 0;
+    bool bad_digit = false;
     bool dot_seen = false;
     bool exp_seen = false;
     while (p->look != HIPACK_IO_EOF && is_number_char (p->look)) {
-        if (!is_hex && (p->look == 'e' || p->look == 'E')) {
-            if (exp_seen || is_octal) {
+        if (base != 16 && (p->look == 'e' || p->look == 'E')) {
+            if (exp_seen || base == 8) {
                 *status = kStatusError;
                 goto error;
             }
@@ -525,75 +841,68 @@ parse_number (P, hipack_value_t *result, S)
             }
         } else {
             if (p->look == '.') {
-                if (dot_seen || is_hex || is_octal) {
+                if (dot_seen || base != 10) {
                     *status = kStatusError;
                     goto error;
                 }
                 dot_seen = true;
-            }
-            if (p->look == '-' || p->look == '+') {
+            } else if (p->look == '-' || p->look == '+') {
                 *status = kStatusError;
                 goto error;
+            } else {
+                unsigned digit = xdigit_to_int (p->look);
+                if (digit >= base)
+                    bad_digit = true;
+                else if (magnitude < cutoff ||
+                         (magnitude == cutoff && digit <= cutoff_digit))
+                    magnitude = magnitude * base + digit;
+                else
+                    magnitude = limit + 1;
+                digits++;
             }
             SAVE_LOOK ();
             nextchar (p, CHECK_OK);
         }
     }
 
-    if (!size) {
-        *status = kStatusError;
-        goto error;
-    }
-
-    /* Zero-terminate, to use with the libc conversion functions. */
-    hstr = string_resize (hstr, &alloc_size, size + 1);
-    hstr->data[size++] = '\0';
-
-    char *endptr = NULL;
-    if (is_hex) {
-        assert (!is_octal);
-        assert (!exp_seen);
-        assert (!dot_seen);
-        char *endptr = NULL;
-        long v = strtol ((const char*) hstr->data, &endptr, 16);
-        /* TODO: Check for overflow. */
-        result->type = HIPACK_INTEGER;
-        result->v_integer = (int32_t) v;
-    } else if (is_octal) {
-        assert (!is_hex);
-        assert (!exp_seen);
-        assert (!dot_seen);
-        long v = strtol ((const char*) hstr->data, &endptr, 8);
-        /* TODO: Check for overflow. */
-        result->type = HIPACK_INTEGER;
-        result->v_integer = (int32_t) v;
-    } else if (dot_seen || exp_seen) {
-        assert (!is_hex);
-        assert (!is_octal);
-        result->type = HIPACK_FLOAT;
-        result->v_float = strtod ((const char*) hstr->data, &endptr);
+    if (dot_seen || exp_seen) {
+        assert (base == 10);
+        number_text_append (p, &text, '\0');
+        const char *data = (const char*) (text.hstr ? text.hstr->data
+                                                    : text.buffer);
+        double value;
+        if (!hipack_float_parse (data, text.size - 1, &value)) {
+            *status = kStatusError;
+            goto error;
+        }
+        set_type (result, HIPACK_FLOAT);
+        result->v_float = value;
     } else {
-        assert (!is_hex);
-        assert (!is_octal);
-        assert (!exp_seen);
-        assert (!dot_seen);
-        long v = strtol ((const char*) hstr->data, &endptr, 10);
-        /* TODO: Check for overflow. */
-        result->type = HIPACK_INTEGER;
-        result->v_integer = (int32_t) v;
+        if (!digits || bad_digit) {
+            *status = kStatusError;
+            goto error;
+        }
+        if (magnitude > limit) {
+            p->error = "integer value out of range";
+            *status = kStatusError;
+            goto out_of_range;
+        }
+        set_type (result, HIPACK_INTEGER);
+        /* Avoids overflowing when negating INT64_MIN. */
+        result->v_integer = (negative && magnitude)
+                          ? -(int64_t) (magnitude - 1) - 1
+                          : (int64_t) magnitude;
     }
 
-    if (endptr && *endptr != '\0') {
-        *status = kStatusError;
-        goto error;
-    }
+#undef SAVE_LOOK
 
-    hipack_string_free (hstr);
+    hipack_string_free_with_allocator (p->allocator, text.hstr);
     return;
 
 error:
     p->error = "invalid numeric value";
-    hipack_string_free (hstr);
+out_of_range:
+    hipack_string_free_with_allocator (p->allocator, text.hstr);
 }
 
 
@@ -614,38 +923,30 @@ parse_annotations (P, hipack_value_t *result, S)
             hipack_type_t annot_type;
             bool found = string_to_intrinsic_annot (key, &annot_type);
             if (found) {
-                if (type_annot && annot_type != result->type) {
+                if (type_annot && annot_type != hipack_value_type (result)) {
                     p->error = "multiple intrinsic type annotations";
                     goto error;
                 }
-                result->type = annot_type;
+                set_type (result, annot_type);
                 type_annot = true;
             } else {
                 p->error = "invalid intrinsic annotation";
                 goto error;
             }
         } else {
-            /* Check if the annotation is already in the set. */
-            if (result->annot && hipack_dict_get (result->annot, key)) {
+            /* Add the annotation to the set, unless it is already there. */
+            if (!hipack_value_add_annot_lstring_with_allocator (p->allocator,
+                                                                result,
+                                                                (const char*) key->data,
+                                                                key->size)) {
                 p->error = "duplicate annotation";
                 goto error;
             }
-            /* Add the annotation to the set. */
-            if (!result->annot)
-                result->annot = hipack_dict_new ();
-
-            static const hipack_value_t annot_present = {
-                .type   = HIPACK_BOOL,
-                .v_bool = true,
-            };
-            hipack_dict_set_adopt_key (result->annot, &key, &annot_present);
         }
     }
     return type_annot;
 
 error:
-    if (key)
-        hipack_string_free (key);
     *status = kStatusError;
     return false;
 }
@@ -657,7 +958,7 @@ parse_value (P, S)
     hipack_value_t result = DUMMY_VALUE;
 
     bool type_annot = parse_annotations (p, &result, CHECK_OK);
-    const hipack_type_t expected_type = result.type;
+    const hipack_type_t expected_type = hipack_value_type (&result);
 
     switch (p->look) {
         case '"': /* String */
@@ -684,7 +985,7 @@ parse_value (P, S)
             break;
     }
 
-    if (type_annot && expected_type != result.type) {
+    if (type_annot && expected_type != hipack_value_type (&result)) {
         p->error = "annotated type does not match value type";
         *status = kStatusError;
         goto error;
@@ -693,7 +994,7 @@ parse_value (P, S)
     return result;
 
 error:
-    hipack_value_free (&result);
+    hipack_value_free_with_allocator (p->allocator, &result);
     return DUMMY_VALUE;
 }
 
@@ -703,6 +1004,8 @@ parse_keyval_items (P, hipack_dict_t *result, int eos, S)
 {
     hipack_value_t value = DUMMY_VALUE;
     hipack_string_t *key = NULL;
+    uint32_t dict_size_hint = 0;
+    key_storage_t key_storage;
 
     while (p->look != eos) {
         key = parse_key (p, CHECK_OK);
@@ -711,6 +1014,7 @@ parse_keyval_items (P, hipack_dict_t *result, int eos, S)
             *status = kStatusError;
             goto error;
         }
+        key = keep_key (p, key, key_storage);
 
         bool got_separator = false;
 
@@ -734,8 +1038,10 @@ parse_keyval_items (P, hipack_dict_t *result, int eos, S)
             goto error;
         }
 
+        p->dict_size_hint = dict_size_hint;
         value = parse_value (p, CHECK_OK);
-        hipack_dict_set_adopt_key (result, &key, &value);
+        update_dict_size_hint (&value, &dict_size_hint);
+        set_key (p, result, &key, &value);
 
         /*
          * There must be either a comma or a whitespace after the value,
@@ -751,15 +1057,15 @@ parse_keyval_items (P, hipack_dict_t *result, int eos, S)
     return;
 
 error:
-    hipack_string_free (key);
-    hipack_value_free (&value);
+    free_key (p, key);
+    hipack_value_free_with_allocator (p->allocator, &value);
 }
 
 
 static hipack_dict_t*
 parse_message (P, S)
 {
-    hipack_dict_t *result = hipack_dict_new ();
+    hipack_dict_t *result = hipack_dict_new_with_allocator (p->allocator);
 
     nextchar (p, CHECK_OK);
     skipwhite (p, CHECK_OK);
@@ -783,36 +1089,30 @@ error:
 }
 
 
-hipack_dict_t*
-hipack_read (hipack_reader_t *reader)
+static hipack_dict_t*
+run_parser (P, hipack_reader_t *reader)
 {
-    assert (reader);
-
     /*
-     * Copy the reader function (and its data pointer) into the parser
-     * structure. The rest of the fields are used as results, so the
-     * reader structure can be cleaned up right after.
+     * The reader callbacks (and their data pointers) have been copied into
+     * the parser structure. The rest of the fields are used as results, so
+     * the reader structure can be cleaned up right away.
      */
-    struct parser p = {
-        .getchar      = reader->getchar,
-        .getchar_data = reader->getchar_data,
-        .line         = 1,
-        0,
-    };
+    p->allocator = reader->allocator;
+    p->intern = reader->intern;
     memset (reader, 0x00, sizeof (hipack_reader_t));
 
     status_t status = kStatusOk;
-    hipack_dict_t *result = parse_message (&p, &status);
+    hipack_dict_t *result = parse_message (p, &status);
     switch (status) {
         case kStatusOk:
             assert (result);
             break;
         case kStatusError:
             assert (!result);
-            assert (p.error);
+            assert (p->error);
             break;
         case kStatusIoError:
-            p.error = HIPACK_READ_ERROR;
+            p->error = HIPACK_READ_ERROR;
             hipack_dict_free (result);
             result = NULL;
             break;
@@ -820,14 +1120,55 @@ hipack_read (hipack_reader_t *reader)
             break;
     }
 
-    reader->error        = p.error;
-    reader->error_line   = p.line;
-    reader->error_column = p.column;
+    hipack_allocator_free (p->allocator, p->key_buffer);
+
+    reader->error        = p->error;
+    reader->error_line   = p->line;
+    reader->error_column = p->column;
 
     return result;
 }
 
 
+hipack_dict_t*
+hipack_read (hipack_reader_t *reader)
+{
+    assert (reader);
+    assert (reader->read || reader->getchar);
+
+    uint8_t buffer[HIPACK_READ_BUFFER_SIZE];
+    struct parser p = {
+        .getchar      = reader->getchar,
+        .getchar_data = reader->getchar_data,
+        .read         = reader->read,
+        .read_data    = reader->read_data,
+        .buffer       = buffer,
+        .line         = 1,
+        0,
+    };
+    return run_parser (&p, reader);
+}
+
+
+hipack_dict_t*
+hipack_read_buffer (const uint8_t   *data,
+                    size_t           length,
+                    hipack_reader_t *reader)
+{
+    assert (data || !length);
+    assert (reader);
+
+    /* The whole input is available: scan it directly. */
+    struct parser p = {
+        .pos  = data,
+        .end  = data + length,
+        .line = 1,
+        0,
+    };
+    return run_parser (&p, reader);
+}
+
+
 int
 hipack_stdio_getchar (void *fp)
 {
@@ -839,3 +1180,16 @@ hipack_stdio_getchar (void *fp)
     return ch;
 }
 
+
+
+int
+hipack_stdio_read (void *fp, uint8_t *buffer, size_t size)
+{
+    assert (fp);
+    assert (buffer);
+    size_t nread = fread (buffer, sizeof (uint8_t), size, (FILE*) fp);
+    if (nread == 0) {
+        return ferror ((FILE*) fp) ? HIPACK_IO_ERROR : HIPACK_IO_EOF;
+    }
+    return (int) nread;
+}
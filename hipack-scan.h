@@ -0,0 +1,421 @@
+/*
+ * hipack-scan.h
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#ifndef HIPACK_SCAN_H
+#define HIPACK_SCAN_H
+
+/*
+ * Scanners used by the parser and the writer to find the end of a run of
+ * bytes which can be handled in bulk. Each scanner returns a pointer to
+ * the first byte in the [pos, end) range which stops the run, or "end" if
+ * there is none:
+ *
+ *  - hipack_scan_string(): stops at quotes and backslashes.
+ *  - hipack_scan_key(): stops at bytes which cannot be part of a key,
+ *    and at '#' (comments are handled by the parser).
+ *  - hipack_scan_whitespace(): stops at the first non-whitespace byte.
+ *  - hipack_scan_escape(): stops at bytes which the writer escapes in
+ *    strings: quotes, backslashes, and control characters.
+ *
+ * There are variants which examine one byte at a time ("bytes"), eight
+ * bytes at a time packed in a 64-bit integer ("swar"), and 16 or 32 bytes
+ * at a time using SSE2 or AVX2 instructions. Each variant hands over the
+ * trailing part of the input which is too short for it to the next smaller
+ * one. AVX2 support is checked at run time. Define HIPACK_SCAN_NO_SIMD to
+ * use only the portable variants.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if !defined(HIPACK_SCAN_NO_SIMD) && defined(__SSE2__)
+# include <emmintrin.h>
+# define HIPACK_SCAN_SSE2 1
+# if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  include <immintrin.h>
+#  define HIPACK_SCAN_AVX2 1
+# endif
+#endif
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+# define HIPACK_SCAN_SWAR 1
+#endif
+
+
+static inline bool
+hipack_scan_is_string_stop (uint8_t ch)
+{
+    return ch == '"' || ch == '\\';
+}
+
+static inline bool
+hipack_scan_is_escape_stop (uint8_t ch)
+{
+    return ch < 0x20 || hipack_scan_is_string_stop (ch);
+}
+
+static inline bool
+hipack_scan_is_key_stop (uint8_t ch)
+{
+    switch (ch) {
+        case 0x09: /* Horizontal tab. */
+        case 0x0A: /* New line. */
+        case 0x0D: /* Carriage return. */
+        case 0x20: /* Space. */
+        case '[':
+        case ']':
+        case '{':
+        case '}':
+        case ':':
+        case ',':
+        case '#':
+            return true;
+        default:
+            return false;
+    }
+}
+
+static inline bool
+hipack_scan_is_whitespace (uint8_t ch)
+{
+    return ch == 0x20 || ch == 0x0A || ch == 0x09 || ch == 0x0D;
+}
+
+
+#define HIPACK_SCAN_DEFINE_BYTES(name, stop_expr)                    \
+    static inline const uint8_t*                                     \
+    hipack_scan_ ## name ## _bytes (const uint8_t *pos,              \
+                                    const uint8_t *end)              \
+    {                                                                \
+        for (; pos < end; pos++) {                                   \
+            const uint8_t ch = *pos;                                 \
+            if (stop_expr) break;                                    \
+        }                                                            \
+        return pos;                                                  \
+    }
+
+HIPACK_SCAN_DEFINE_BYTES (string,     hipack_scan_is_string_stop (ch))
+HIPACK_SCAN_DEFINE_BYTES (key,        hipack_scan_is_key_stop (ch))
+HIPACK_SCAN_DEFINE_BYTES (whitespace, !hipack_scan_is_whitespace (ch))
+HIPACK_SCAN_DEFINE_BYTES (escape,     hipack_scan_is_escape_stop (ch))
+
+#undef HIPACK_SCAN_DEFINE_BYTES
+
+
+/*
+ * The block scanners below find "candidate" bytes for keys: the set of
+ * bytes which cannot be part of a key is approximated with all the bytes
+ * up to 0x20, which is cheaper to check. Candidates which turn out to be
+ * valid key characters (control characters) are skipped afterwards by
+ * hipack_scan_key().
+ */
+
+#if HIPACK_SCAN_SWAR
+
+#define SWAR_ONES  UINT64_C(0x0101010101010101)
+#define SWAR_HIGHS UINT64_C(0x8080808080808080)
+#define SWAR_LOWS  UINT64_C(0x7F7F7F7F7F7F7F7F)
+
+/* Sets the high bit of each byte of "v" which is zero. */
+static inline uint64_t
+hipack_swar_zero (uint64_t v)
+{
+    return ~(((v & SWAR_LOWS) + SWAR_LOWS) | v | SWAR_LOWS);
+}
+
+/* Sets the high bit of each byte of "v" which is equal to "ch". */
+static inline uint64_t
+hipack_swar_eq (uint64_t v, uint8_t ch)
+{
+    return hipack_swar_zero (v ^ (SWAR_ONES * ch));
+}
+
+/* Sets the high bit of each byte of "v" which is lower or equal than 0x20. */
+static inline uint64_t
+hipack_swar_le_space (uint64_t v)
+{
+    return ~(((v & SWAR_LOWS) + SWAR_ONES * (0x80 - 0x21)) | v) & SWAR_HIGHS;
+}
+
+/* Sets the high bit of each byte of "v" which is a control character. */
+static inline uint64_t
+hipack_swar_control (uint64_t v)
+{
+    return ~(((v & SWAR_LOWS) + SWAR_ONES * (0x80 - 0x20)) | v) & SWAR_HIGHS;
+}
+
+static inline uint64_t
+hipack_swar_string (uint64_t v)
+{
+    return hipack_swar_eq (v, '"') | hipack_swar_eq (v, '\\');
+}
+
+static inline uint64_t
+hipack_swar_escape (uint64_t v)
+{
+    return hipack_swar_string (v) | hipack_swar_control (v);
+}
+
+static inline uint64_t
+hipack_swar_key (uint64_t v)
+{
+    /* Setting bit 0x20 maps '[' to '{', and ']' to '}'. */
+    const uint64_t lower = v | (SWAR_ONES * 0x20);
+    return hipack_swar_le_space (v) |
+        hipack_swar_eq (lower, '{') | hipack_swar_eq (lower, '}') |
+        hipack_swar_eq (v, ':') | hipack_swar_eq (v, ',') |
+        hipack_swar_eq (v, '#');
+}
+
+static inline uint64_t
+hipack_swar_whitespace (uint64_t v)
+{
+    const uint64_t ws = hipack_swar_eq (v, ' ') | hipack_swar_eq (v, '\n') |
+        hipack_swar_eq (v, '\t') | hipack_swar_eq (v, '\r');
+    return ~ws & SWAR_HIGHS;
+}
+
+#undef SWAR_ONES
+#undef SWAR_HIGHS
+#undef SWAR_LOWS
+
+#define HIPACK_SCAN_DEFINE_SWAR(name)                                \
+    static inline const uint8_t*                                     \
+    hipack_scan_ ## name ## _swar (const uint8_t *pos,               \
+                                   const uint8_t *end)               \
+    {                                                                \
+        for (; end - pos >= 8; pos += 8) {                           \
+            uint64_t v;                                              \
+            memcpy (&v, pos, sizeof (v));                            \
+            uint64_t mask = hipack_swar_ ## name (v);                \
+            if (mask)                                                \
+                return pos + (__builtin_ctzll (mask) >> 3);          \
+        }                                                            \
+        return hipack_scan_ ## name ## _bytes (pos, end);            \
+    }
+
+#else /* !HIPACK_SCAN_SWAR */
+
+#define HIPACK_SCAN_DEFINE_SWAR(name)                                \
+    static inline const uint8_t*                                     \
+    hipack_scan_ ## name ## _swar (const uint8_t *pos,               \
+                                   const uint8_t *end)               \
+    {                                                                \
+        return hipack_scan_ ## name ## _bytes (pos, end);            \
+    }
+
+#endif /* HIPACK_SCAN_SWAR */
+
+HIPACK_SCAN_DEFINE_SWAR (string)
+HIPACK_SCAN_DEFINE_SWAR (key)
+HIPACK_SCAN_DEFINE_SWAR (whitespace)
+HIPACK_SCAN_DEFINE_SWAR (escape)
+
+#undef HIPACK_SCAN_DEFINE_SWAR
+
+
+#if HIPACK_SCAN_SSE2
+
+static inline int
+hipack_sse2_string (__m128i v)
+{
+    return _mm_movemask_epi8 (_mm_or_si128 (
+        _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('"')),
+        _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\\'))));
+}
+
+static inline int
+hipack_sse2_key (__m128i v)
+{
+    const __m128i lower = _mm_or_si128 (v, _mm_set1_epi8 (0x20));
+    const __m128i le_space =
+        _mm_cmpeq_epi8 (_mm_min_epu8 (v, _mm_set1_epi8 (0x20)), v);
+    return _mm_movemask_epi8 (_mm_or_si128 (
+        _mm_or_si128 (le_space,
+                      _mm_or_si128 (_mm_cmpeq_epi8 (lower, _mm_set1_epi8 ('{')),
+                                    _mm_cmpeq_epi8 (lower, _mm_set1_epi8 ('}')))),
+        _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 (':')),
+                      _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 (',')),
+                                    _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('#'))))));
+}
+
+static inline int
+hipack_sse2_whitespace (__m128i v)
+{
+    const __m128i ws = _mm_or_si128 (
+        _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 (' ')),
+                      _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\n'))),
+        _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\t')),
+                      _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\r'))));
+    return _mm_movemask_epi8 (ws) ^ 0xFFFF;
+}
+
+static inline int
+hipack_sse2_escape (__m128i v)
+{
+    const __m128i control =
+        _mm_cmpeq_epi8 (_mm_min_epu8 (v, _mm_set1_epi8 (0x1F)), v);
+    return _mm_movemask_epi8 (_mm_or_si128 (control, _mm_or_si128 (
+        _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('"')),
+        _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\\')))));
+}
+
+#define HIPACK_SCAN_DEFINE_SSE2(name)                                     \
+    static inline const uint8_t*                                          \
+    hipack_scan_ ## name ## _sse2 (const uint8_t *pos,                    \
+                                   const uint8_t *end)                    \
+    {                                                                     \
+        for (; end - pos >= 16; pos += 16) {                              \
+            int mask = hipack_sse2_ ## name (                             \
+                _mm_loadu_si128 ((const __m128i*) pos));                  \
+            if (mask)                                                     \
+                return pos + __builtin_ctz (mask);                        \
+        }                                                                 \
+        return hipack_scan_ ## name ## _swar (pos, end);                  \
+    }
+
+HIPACK_SCAN_DEFINE_SSE2 (string)
+HIPACK_SCAN_DEFINE_SSE2 (key)
+HIPACK_SCAN_DEFINE_SSE2 (whitespace)
+HIPACK_SCAN_DEFINE_SSE2 (escape)
+
+#undef HIPACK_SCAN_DEFINE_SSE2
+
+#endif /* HIPACK_SCAN_SSE2 */
+
+
+#if HIPACK_SCAN_AVX2
+
+#define HIPACK_AVX2 __attribute__((target ("avx2")))
+
+static inline HIPACK_AVX2 uint32_t
+hipack_avx2_string (__m256i v)
+{
+    return _mm256_movemask_epi8 (_mm256_or_si256 (
+        _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('"')),
+        _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\\'))));
+}
+
+static inline HIPACK_AVX2 uint32_t
+hipack_avx2_key (__m256i v)
+{
+    const __m256i lower = _mm256_or_si256 (v, _mm256_set1_epi8 (0x20));
+    const __m256i le_space =
+        _mm256_cmpeq_epi8 (_mm256_min_epu8 (v, _mm256_set1_epi8 (0x20)), v);
+    return _mm256_movemask_epi8 (_mm256_or_si256 (
+        _mm256_or_si256 (le_space,
+                         _mm256_or_si256 (_mm256_cmpeq_epi8 (lower, _mm256_set1_epi8 ('{')),
+                                          _mm256_cmpeq_epi8 (lower, _mm256_set1_epi8 ('}')))),
+        _mm256_or_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 (':')),
+                         _mm256_or_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 (',')),
+                                          _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('#'))))));
+}
+
+static inline HIPACK_AVX2 uint32_t
+hipack_avx2_whitespace (__m256i v)
+{
+    const __m256i ws = _mm256_or_si256 (
+        _mm256_or_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 (' ')),
+                         _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\n'))),
+        _mm256_or_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\t')),
+                         _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\r'))));
+    return ~(uint32_t) _mm256_movemask_epi8 (ws);
+}
+
+static inline HIPACK_AVX2 uint32_t
+hipack_avx2_escape (__m256i v)
+{
+    const __m256i control =
+        _mm256_cmpeq_epi8 (_mm256_min_epu8 (v, _mm256_set1_epi8 (0x1F)), v);
+    return _mm256_movemask_epi8 (_mm256_or_si256 (control, _mm256_or_si256 (
+        _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('"')),
+        _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\\')))));
+}
+
+#define HIPACK_SCAN_DEFINE_AVX2(name)                                     \
+    static inline HIPACK_AVX2 const uint8_t*                                   \
+    hipack_scan_ ## name ## _avx2 (const uint8_t *pos,                    \
+                                   const uint8_t *end)                    \
+    {                                                                     \
+        for (; end - pos >= 32; pos += 32) {                              \
+            uint32_t mask = hipack_avx2_ ## name (                        \
+                _mm256_loadu_si256 ((const __m256i*) pos));               \
+            if (mask)                                                     \
+                return pos + __builtin_ctz (mask);                        \
+        }                                                                 \
+        return hipack_scan_ ## name ## _sse2 (pos, end);                  \
+    }
+
+HIPACK_SCAN_DEFINE_AVX2 (string)
+HIPACK_SCAN_DEFINE_AVX2 (key)
+HIPACK_SCAN_DEFINE_AVX2 (whitespace)
+HIPACK_SCAN_DEFINE_AVX2 (escape)
+
+#undef HIPACK_SCAN_DEFINE_AVX2
+#undef HIPACK_AVX2
+
+static inline bool
+hipack_scan_have_avx2 (void)
+{
+    return __builtin_cpu_supports ("avx2");
+}
+
+#endif /* HIPACK_SCAN_AVX2 */
+
+
+/*
+ * Picks the widest variant available. Short runs are handed directly to
+ * the SSE2 or SWAR variants, which avoids the run time check for AVX2.
+ */
+#if HIPACK_SCAN_AVX2
+# define HIPACK_SCAN_DISPATCH(name, pos, end)                             \
+    (((end) - (pos) >= 32 && hipack_scan_have_avx2 ())                    \
+        ? hipack_scan_ ## name ## _avx2 ((pos), (end))                    \
+        : hipack_scan_ ## name ## _sse2 ((pos), (end)))
+#elif HIPACK_SCAN_SSE2
+# define HIPACK_SCAN_DISPATCH(name, pos, end)                             \
+    hipack_scan_ ## name ## _sse2 ((pos), (end))
+#else
+# define HIPACK_SCAN_DISPATCH(name, pos, end)                             \
+    hipack_scan_ ## name ## _swar ((pos), (end))
+#endif
+
+
+static inline const uint8_t*
+hipack_scan_string (const uint8_t *pos, const uint8_t *end)
+{
+    return HIPACK_SCAN_DISPATCH (string, pos, end);
+}
+
+static inline const uint8_t*
+hipack_scan_key (const uint8_t *pos, const uint8_t *end)
+{
+    for (;;) {
+        pos = HIPACK_SCAN_DISPATCH (key, pos, end);
+        if (pos == end || hipack_scan_is_key_stop (*pos))
+            return pos;
+        pos++; /* Control character, which is valid in keys. */
+    }
+}
+
+static inline const uint8_t*
+hipack_scan_whitespace (const uint8_t *pos, const uint8_t *end)
+{
+    return HIPACK_SCAN_DISPATCH (whitespace, pos, end);
+}
+
+static inline const uint8_t*
+hipack_scan_escape (const uint8_t *pos, const uint8_t *end)
+{
+    return HIPACK_SCAN_DISPATCH (escape, pos, end);
+}
+
+#undef HIPACK_SCAN_DISPATCH
+
+#endif /* !HIPACK_SCAN_H */
@@ -24,11 +24,20 @@ hipack_string_new_from_string (const char *str)
 
 hipack_string_t*
 hipack_string_new_from_lstring (const char *str, uint32_t len)
+{
+    return hipack_string_new_from_lstring_with_allocator (NULL, str, len);
+}
+
+
+hipack_string_t*
+hipack_string_new_from_lstring_with_allocator (const hipack_allocator_t *allocator,
+                                               const char               *str,
+                                               uint32_t                  len)
 {
     assert (str);
     if (len > 0) {
-        hipack_string_t *hstr = hipack_alloc_array_extra (NULL,
-                len, sizeof (uint8_t), sizeof (hipack_string_t));
+        hipack_string_t *hstr = hipack_allocator_alloc_array_extra (allocator,
+                NULL, len, sizeof (uint8_t), sizeof (hipack_string_t));
         memcpy (hstr->data, str, len);
         hstr->size = len;
         return hstr;
@@ -40,40 +49,163 @@ hipack_string_new_from_lstring (const char *str, uint32_t len)
 
 hipack_string_t*
 hipack_string_copy (const hipack_string_t *hstr)
+{
+    return hipack_string_copy_with_allocator (NULL, hstr);
+}
+
+
+hipack_string_t*
+hipack_string_copy_with_allocator (const hipack_allocator_t *allocator,
+                                   const hipack_string_t    *hstr)
 {
     assert (hstr);
 
     if (hstr == &s_empty_string)
         return &s_empty_string;
 
-    return hipack_string_new_from_lstring ((const char*) hstr->data,
-                                           hstr->size);
+    return hipack_string_new_from_lstring_with_allocator (allocator,
+                                                          (const char*) hstr->data,
+                                                          hstr->size);
 }
 
 
 void
 hipack_string_free (hipack_string_t *hstr)
+{
+    hipack_string_free_with_allocator (NULL, hstr);
+}
+
+
+void
+hipack_string_free_with_allocator (const hipack_allocator_t *allocator,
+                                   hipack_string_t          *hstr)
 {
     if (hstr && hstr != &s_empty_string) {
-        hipack_alloc_free (hstr);
+        hipack_allocator_free (allocator, hstr);
     }
 }
 
 
+/*
+ * String hashing uses the wyhash algorithm by Wang Yi (public domain): it
+ * reads the input a word at a time, and mixes it using 64x64->128 bit
+ * multiplications. The 64-bit result is truncated to 32 bits.
+ */
+static const uint64_t s_hash_secret[4] = {
+    UINT64_C (0x2d358dccaa6c78a5), UINT64_C (0x8bb84b93962eacc9),
+    UINT64_C (0x4b33a62ed433d4a3), UINT64_C (0x4d5a2da51de1aa47),
+};
+
+static uint64_t s_hash_seed = 0;
+
+
+static inline void
+hash_mum (uint64_t *a, uint64_t *b)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t) *a * *b;
+    *a = (uint64_t) r;
+    *b = (uint64_t) (r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t) *a, lb = (uint32_t) *b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+
+static inline uint64_t
+hash_mix (uint64_t a, uint64_t b)
+{
+    hash_mum (&a, &b);
+    return a ^ b;
+}
+
+
+static inline uint64_t
+hash_read8 (const uint8_t *p)
+{
+    uint64_t v;
+    memcpy (&v, p, sizeof (v));
+    return v;
+}
+
+
+static inline uint64_t
+hash_read4 (const uint8_t *p)
+{
+    uint32_t v;
+    memcpy (&v, p, sizeof (v));
+    return v;
+}
+
+
+void
+hipack_string_hash_set_seed (uint64_t seed)
+{
+    s_hash_seed = seed;
+}
+
+
 uint32_t
 hipack_string_hash (const hipack_string_t *hstr)
 {
     assert (hstr);
+    return hipack_lstring_hash ((const char*) hstr->data, hstr->size);
+}
 
-    uint32_t ret = 0;
-    uint32_t ctr = 0;
 
-    for (uint32_t i = 0; i < hstr->size; i++) {
-        ret ^= hstr->data[i] << ctr;
-        ctr  = (ctr + 1) % sizeof (void*);
+uint32_t
+hipack_lstring_hash (const char *str, uint32_t len)
+{
+    assert (str || !len);
+
+    const uint8_t *p = (const uint8_t*) str;
+    const uint64_t *secret = s_hash_secret;
+    uint64_t seed = s_hash_seed ^ hash_mix (s_hash_seed ^ secret[0], secret[1]);
+    uint64_t a, b;
+
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (hash_read4 (p) << 32) | hash_read4 (p + ((len >> 3) << 2));
+            b = (hash_read4 (p + len - 4) << 32)
+              | hash_read4 (p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = ((uint64_t) p[0] << 16) | ((uint64_t) p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t seed1 = seed, seed2 = seed;
+            do {
+                seed  = hash_mix (hash_read8 (p)      ^ secret[1], hash_read8 (p + 8)  ^ seed);
+                seed1 = hash_mix (hash_read8 (p + 16) ^ secret[2], hash_read8 (p + 24) ^ seed1);
+                seed2 = hash_mix (hash_read8 (p + 32) ^ secret[3], hash_read8 (p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (i > 16) {
+            seed = hash_mix (hash_read8 (p) ^ secret[1], hash_read8 (p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = hash_read8 (p + i - 16);
+        b = hash_read8 (p + i - 8);
     }
 
-    return ret;
+    a ^= secret[1];
+    b ^= seed;
+    hash_mum (&a, &b);
+    return (uint32_t) hash_mix (a ^ secret[0] ^ len, b ^ secret[1]);
 }
 
 
@@ -6,6 +6,8 @@
  */
 
 #include "hipack.h"
+#include "hipack-scan.h"
+#include <string.h>
 
 /*
  * Define FPCONV_H to avoid fpconv/src/fpconv.h being included.
@@ -17,12 +19,74 @@ static inline int fpconv_dtoa (double fp, char dest[24]);
 #include "fpconv/src/fpconv.c"
 
 
+#ifndef HIPACK_WRITE_BUFFER_SIZE
+#define HIPACK_WRITE_BUFFER_SIZE 4096
+#endif /* !HIPACK_WRITE_BUFFER_SIZE */
+
+
+#define CHECK_IO(statement)         \
+    do {                            \
+        if (statement) return true; \
+    } while (0)
+
+
+static bool
+flush (hipack_writer_t *writer)
+{
+    assert (writer->write);
+    if (!writer->buffer_used)
+        return false;
+
+    int ret = (*writer->write) (writer->write_data, writer->buffer,
+                                writer->buffer_used);
+    assert (ret != HIPACK_IO_EOF);
+    writer->buffer_used = 0;
+    return ret == HIPACK_IO_ERROR;
+}
+
+
+static bool
+release_buffer (hipack_writer_t *writer, bool error)
+{
+    if (!error)
+        error = flush (writer);
+    writer->buffer = NULL;
+    writer->buffer_used = 0;
+    return error;
+}
+
+
+/*
+ * Used at the beginning of the public writing functions: when there is a
+ * block writer callback and no output buffer yet, makes "statement" (a
+ * call to the function itself) use one in the stack, and flushes it before
+ * returning. Nested calls use the same buffer.
+ */
+#define WITH_BUFFER(writer, statement)                          \
+    do {                                                        \
+        if ((writer)->write && !(writer)->buffer) {             \
+            uint8_t buffer_[HIPACK_WRITE_BUFFER_SIZE];          \
+            (writer)->buffer = buffer_;                         \
+            (writer)->buffer_used = 0;                          \
+            bool error_ = (statement);                          \
+            return release_buffer ((writer), error_);           \
+        }                                                       \
+    } while (0)
+
+
 static inline bool
 writechar (hipack_writer_t *writer, int ch)
 {
     assert (ch != HIPACK_IO_ERROR);
     assert (ch != HIPACK_IO_EOF);
 
+    if (writer->buffer) {
+        if (writer->buffer_used == HIPACK_WRITE_BUFFER_SIZE)
+            CHECK_IO (flush (writer));
+        writer->buffer[writer->buffer_used++] = (uint8_t) ch;
+        return false;
+    }
+
     assert (writer->putchar);
 
     int ret = (*writer->putchar) (writer->putchar_data, ch);
@@ -31,12 +95,6 @@ writechar (hipack_writer_t *writer, int ch)
 }
 
 
-#define CHECK_IO(statement)         \
-    do {                            \
-        if (statement) return true; \
-    } while (0)
-
-
 static inline void
 moreindent (hipack_writer_t *writer)
 {
@@ -72,39 +130,68 @@ writedata (hipack_writer_t *writer,
 {
     if (length) {
         assert (data);
-        while (length--) {
-            CHECK_IO (writechar (writer, *data++));
+        if (writer->buffer) {
+            for (;;) {
+                uint32_t n = HIPACK_WRITE_BUFFER_SIZE - writer->buffer_used;
+                if (n > length)
+                    n = length;
+                memcpy (writer->buffer + writer->buffer_used, data, n);
+                writer->buffer_used += n;
+                if (!(length -= n))
+                    break;
+                data += n;
+                CHECK_IO (flush (writer));
+            }
+        } else {
+            while (length--) {
+                CHECK_IO (writechar (writer, *data++));
+            }
         }
     }
     return false;
 }
 
 
-static inline int
-mapdigit (unsigned n)
-{
-    if (n < 10) {
-        return '0' + n;
-    }
-    if (n < 36) {
-        return 'A' + (n - 10);
-    }
-    assert (false);
-    return '?';
-}
+static const char s_hex_digits[] = "0123456789ABCDEF";
 
+/* Decimal representations of the numbers from 00 to 99. */
+static const char s_digit_pairs[] =
+    "00010203040506070809" "10111213141516171819"
+    "20212223242526272829" "30313233343536373839"
+    "40414243444546474849" "50515253545556575859"
+    "60616263646566676869" "70717273747576777879"
+    "80818283848586878889" "90919293949596979899";
 
+
+/*
+ * Formats the digits from the end of a buffer in the stack, two at a
+ * time, and writes them at once. The buffer has room for the 20 digits
+ * of UINT64_MAX, plus the sign.
+ */
 static inline bool
 formatint (hipack_writer_t *writer,
-           int              value,
-           uint8_t          base)
+           uint64_t         value,
+           bool             negative)
 {
-    assert (writer);
-    if (value >= base) {
-        CHECK_IO (formatint (writer, value / base, base));
+    char buf[21];
+    char *pos = buf + sizeof (buf);
+
+    while (value >= 100) {
+        const unsigned pair = (unsigned) (value % 100) * 2;
+        value /= 100;
+        pos -= 2;
+        memcpy (pos, s_digit_pairs + pair, 2);
     }
-    CHECK_IO (writechar (writer, mapdigit (value % base)));
-    return false;
+    if (value >= 10) {
+        pos -= 2;
+        memcpy (pos, s_digit_pairs + value * 2, 2);
+    } else {
+        *--pos = '0' + (char) value;
+    }
+    if (negative)
+        *--pos = '-';
+
+    return writedata (writer, pos, buf + sizeof (buf) - pos);
 }
 
 
@@ -113,6 +200,7 @@ hipack_write_bool (hipack_writer_t *writer,
                    const bool       value)
 {
     assert (writer);
+    WITH_BUFFER (writer, hipack_write_bool (writer, value));
     if (value) {
         return writedata (writer, "True", 4);
     } else {
@@ -123,15 +211,13 @@ hipack_write_bool (hipack_writer_t *writer,
 
 bool
 hipack_write_integer (hipack_writer_t *writer,
-                      const int32_t    value)
+                      const int64_t    value)
 {
     assert (writer);
-    if (value < 0) {
-        CHECK_IO (writechar (writer, '-'));
-        return formatint (writer, -value, 10);
-    } else {
-        return formatint (writer, value, 10);
-    }
+    WITH_BUFFER (writer, hipack_write_integer (writer, value));
+    /* Negating the unsigned value also works for INT64_MIN. */
+    return (value < 0) ? formatint (writer, UINT64_C (0) - (uint64_t) value, true)
+                       : formatint (writer, (uint64_t) value, false);
 }
 
 
@@ -140,21 +226,17 @@ hipack_write_float (hipack_writer_t *writer,
                     const double     value)
 {
     assert (writer);
+    WITH_BUFFER (writer, hipack_write_float (writer, value));
 
     char buf[24];
     int nchars = fpconv_dtoa (value, buf);
-    bool need_dot = true;
+    CHECK_IO (writedata (writer, buf, nchars));
     for (int i = 0; i < nchars; i++) {
-        CHECK_IO (writechar (writer, buf[i]));
         if (buf[i] == '.' || buf[i] == 'e' || buf[i] == 'E') {
-            need_dot = false;
+            return false;
         }
     }
-    if (need_dot) {
-        CHECK_IO (writechar (writer, '.'));
-        CHECK_IO (writechar (writer, '0'));
-    }
-    return false;
+    return writedata (writer, ".0", 2);
 }
 
 
@@ -164,9 +246,20 @@ hipack_write_string (hipack_writer_t       *writer,
 {
     assert (writer);
     assert (hstr);
+    WITH_BUFFER (writer, hipack_write_string (writer, hstr));
     CHECK_IO (writechar (writer, '"'));
-    for (uint32_t i = 0; i < hstr->size; i++) {
-        switch (hstr->data[i]) {
+
+    /* Runs of bytes which do not need escaping are written at once. */
+    const uint8_t *pos = hstr->data;
+    const uint8_t *end = pos + hstr->size;
+    for (;;) {
+        const uint8_t *stop = hipack_scan_escape (pos, end);
+        CHECK_IO (writedata (writer, (const char*) pos, stop - pos));
+        if (stop == end)
+            break;
+        pos = stop + 1;
+
+        switch (*stop) {
             case 0x09: /* Horizontal tab. */
                 CHECK_IO (writechar (writer, '\\'));
                 CHECK_IO (writechar (writer, 't'));
@@ -188,17 +281,11 @@ hipack_write_string (hipack_writer_t       *writer,
                 CHECK_IO (writechar (writer, '\\'));
                 break;
             default:
-                if (hstr->data[i] < 0x20) {
-                    /* ASCII non-printable character. */
-                    CHECK_IO (writechar (writer, '\\'));
-                    if ((uint8_t) hstr->data[i] < 16) {
-                        /* Leading zero. */
-                        CHECK_IO (writechar (writer, '0'));
-                    }
-                    CHECK_IO (formatint (writer, (uint8_t) hstr->data[i], 16));
-                } else {
-                    CHECK_IO (writechar (writer, hstr->data[i]));
-                }
+                /* ASCII non-printable character, as two hex digits. */
+                assert (*stop < 0x20);
+                CHECK_IO (writechar (writer, '\\'));
+                CHECK_IO (writechar (writer, s_hex_digits[*stop >> 4]));
+                CHECK_IO (writechar (writer, s_hex_digits[*stop & 0xF]));
         }
     }
     CHECK_IO (writechar (writer, '"'));
@@ -218,18 +305,16 @@ write_keyval (hipack_writer_t     *writer,
     HIPACK_DICT_FOREACH (dict, key, value) {
         writeindent (writer);
         /* Key */
-        for (uint32_t i = 0; i < key->size; i++) {
-            CHECK_IO (writechar (writer, key->data[i]));
-        }
+        CHECK_IO (writedata (writer, (const char*) key->data, key->size));
 
-        if (value->annot) {
+        if (hipack_value_annot (value)) {
             if (writer->indent == HIPACK_WRITER_COMPACT) {
                 CHECK_IO (writechar (writer, ':'));
             } else {
                 CHECK_IO (writechar (writer, ' '));
             }
         } else {
-            switch (value->type) {
+            switch (hipack_value_type (value)) {
                 case HIPACK_INTEGER:
                 case HIPACK_FLOAT:
                 case HIPACK_BOOL:
@@ -267,6 +352,7 @@ hipack_write_list (hipack_writer_t     *writer,
 {
     assert (writer);
     assert (list);
+    WITH_BUFFER (writer, hipack_write_list (writer, list));
 
     CHECK_IO (writechar (writer, '['));
 
@@ -298,6 +384,10 @@ bool
 hipack_write_dict (hipack_writer_t     *writer,
                    const hipack_dict_t *dict)
 {
+    assert (writer);
+    assert (dict);
+    WITH_BUFFER (writer, hipack_write_dict (writer, dict));
+
     CHECK_IO (writechar (writer, '{'));
 
     if (hipack_dict_size (dict)) {
@@ -321,20 +411,19 @@ hipack_write_value (hipack_writer_t      *writer,
 {
     assert (writer);
     assert (value);
+    WITH_BUFFER (writer, hipack_write_value (writer, value));
 
-    if (value->annot) {
-        const hipack_string_t *key;
-        hipack_value_t *dummy_value;
-        HIPACK_DICT_FOREACH (value->annot, key, dummy_value) {
+    if (hipack_value_annot (value)) {
+        const hipack_string_t *annot;
+        HIPACK_ANNOT_FOREACH (value, annot) {
             CHECK_IO (writechar (writer, ':'));
-            for (uint32_t i = 0; i < key->size; i++) {
-                CHECK_IO (writechar (writer, key->data[i]));
-            }
+            CHECK_IO (writedata (writer, (const char*) annot->data,
+                                 annot->size));
         }
         CHECK_IO (writechar (writer, ' '));
     }
 
-    switch (value->type) {
+    switch (hipack_value_type (value)) {
         case HIPACK_INTEGER:
             return hipack_write_integer (writer, value->v_integer);
         case HIPACK_FLOAT:
@@ -360,6 +449,7 @@ hipack_write (hipack_writer_t     *writer,
 {
     assert (writer);
     assert (message);
+    WITH_BUFFER (writer, hipack_write (writer, message));
     if (writer->indent != HIPACK_WRITER_COMPACT) {
         writer->indent = HIPACK_WRITER_INDENTED;
     }
@@ -367,6 +457,90 @@ hipack_write (hipack_writer_t     *writer,
 }
 
 
+static int
+count_write (void *data, const uint8_t *buffer, size_t size)
+{
+    (void) buffer;
+    *((size_t*) data) += size;
+    return (int) size;
+}
+
+
+size_t
+hipack_write_size (const hipack_dict_t *message,
+                   int32_t              indent)
+{
+    assert (message);
+
+    size_t size = 0;
+    hipack_writer_t writer = {
+        .indent = indent,
+        .write = count_write,
+        .write_data = &size,
+    };
+    /* Counting never fails. */
+    hipack_write (&writer, message);
+    return size;
+}
+
+
+struct output_buffer {
+    uint8_t *data;
+    size_t   size;
+    size_t   alloc;
+};
+
+
+static int
+output_buffer_write (void *data, const uint8_t *buffer, size_t size)
+{
+    struct output_buffer *out = data;
+    /* Always keep room for the nul terminator. */
+    if (out->alloc - out->size <= size) {
+        while (out->alloc - out->size <= size)
+            out->alloc *= 2;
+        out->data = (*hipack_alloc) (out->data, out->alloc);
+    }
+    memcpy (out->data + out->size, buffer, size);
+    out->size += size;
+    return (int) size;
+}
+
+
+uint8_t*
+hipack_write_to_buffer (const hipack_dict_t *message,
+                        int32_t              indent,
+                        bool                 exact_size,
+                        size_t              *length)
+{
+    assert (message);
+    assert (length);
+
+    struct output_buffer out = {
+        .alloc = exact_size ? hipack_write_size (message, indent) + 1
+                            : HIPACK_WRITE_BUFFER_SIZE,
+    };
+    out.data = (*hipack_alloc) (NULL, out.alloc);
+
+    hipack_writer_t writer = {
+        .indent = indent,
+        .write = output_buffer_write,
+        .write_data = &out,
+    };
+    /* Writing to memory never fails. */
+    hipack_write (&writer, message);
+
+    /* Release the excess memory, if any. */
+    assert (out.size < out.alloc);
+    if (out.alloc - out.size > 1)
+        out.data = (*hipack_alloc) (out.data, out.size + 1);
+    out.data[out.size] = '\0';
+
+    *length = out.size;
+    return out.data;
+}
+
+
 int
 hipack_stdio_putchar (void* fp, int ch)
 {
@@ -374,3 +548,13 @@ hipack_stdio_putchar (void* fp, int ch)
     int ret = fputc (ch, (FILE*) fp);
     return (ret == EOF) ? HIPACK_IO_ERROR : ch;
 }
+
+
+int
+hipack_stdio_write (void *fp, const uint8_t *buffer, size_t size)
+{
+    assert (fp);
+    assert (buffer);
+    size_t nwritten = fwrite (buffer, sizeof (uint8_t), size, (FILE*) fp);
+    return (nwritten < size) ? HIPACK_IO_ERROR : (int) nwritten;
+}
@@ -27,7 +27,7 @@
  *
  * Type of a value. This enumeration takes one of the following values:
  *
- * - ``HIPACK_INTEGER``: Integer value.
+ * - ``HIPACK_INTEGER``: Integer value, in the range of ``int64_t``.
  * - ``HIPACK_FLOAT``: Floating point value.
  * - ``HIPACK_BOOL``: Boolean value.
  * - ``HIPACK_STRING``: String value.
@@ -50,6 +50,7 @@ typedef struct hipack_string    hipack_string_t;
 typedef struct hipack_dict      hipack_dict_t;
 typedef struct hipack_dict_node hipack_dict_node_t;
 typedef struct hipack_list      hipack_list_t;
+typedef struct hipack_annot     hipack_annot_t;
 
 
 /*~t hipack_value_t
@@ -57,20 +58,29 @@ typedef struct hipack_list      hipack_list_t;
  * Represent any valid HiPack value.
  *
  * - :func:`hipack_value_type()` obtains the type of a value.
+ *
+ * Values take 16 bytes in 64-bit systems: the type is kept in the lowest
+ * bits of the pointer to the annotations, which are stored out of line.
+ * The ``tag`` member must not be used directly.
  */
 struct hipack_value {
-    hipack_type_t  type;
-    hipack_dict_t *annot;
     union {
-        int32_t          v_integer;
+        int64_t          v_integer;
         double           v_float;
         bool             v_bool;
         hipack_string_t *v_string;
         hipack_list_t   *v_list;
         hipack_dict_t   *v_dict;
     };
+    uintptr_t tag;
 };
 
+/*
+ * Bits of the "tag" member of hipack_value_t which hold the type. The
+ * memory for annotations is allocated with at least this alignment.
+ */
+#define HIPACK_VALUE_TYPE_MASK ((uintptr_t) 7)
+
 
 /*~t hipack_string_t
  *
@@ -90,15 +100,26 @@ struct hipack_list {
     hipack_value_t data[]; /* C99 flexible array. */
 };
 
+/*~M HIPACK_DICT_INLINE_KEY_SIZE
+ * Keys of up to this many bytes are stored in the entries of dictionaries,
+ * instead of in separately allocated strings.
+ */
+#define HIPACK_DICT_INLINE_KEY_SIZE 16
+
 /*~t hipack_dict_t
  *
  * Dictionary value.
  */
 struct hipack_dict {
-    hipack_dict_node_t **nodes;
-    hipack_dict_node_t  *first;
-    uint32_t             count;
-    uint32_t             size;
+    hipack_dict_node_t *entries; /* Insertion order, followed by index. */
+    uint32_t           *index;   /* Slots: entry position + 1, 0 = empty. */
+    uint32_t            count;   /* Number of entries in the dictionary. */
+    uint32_t            used;    /* Used entries, including removed ones. */
+    uint32_t            size;    /* Number of slots, a power of two. */
+    uint32_t            shift;   /* Used to map hash values to slots. */
+    uint32_t            buckets; /* Frozen, perfect hashing: displacements. */
+    bool                frozen;
+    const struct hipack_allocator *allocator;
 };
 
 
@@ -107,7 +128,11 @@ struct hipack_dict {
  * =================
  *
  * How ``hipack-c`` allocates memory can be customized by setting
- * :c:data:`hipack_alloc` to a custom allocation function.
+ * :c:data:`hipack_alloc` to a custom allocation function, which is used
+ * globally by default. Alternatively, an :c:type:`hipack_allocator_t` can
+ * be passed to the functions which create values, and to the parser (see
+ * :c:type:`hipack_reader_t`), which allows using different allocators
+ * e.g. for each thread.
  */
 
 /*~v hipack_alloc
@@ -196,6 +221,79 @@ hipack_alloc_free (void *optr)
     (*hipack_alloc) (optr, 0);
 }
 
+/*~t hipack_allocator_t
+ *
+ * Allocator context. Functions which accept an allocator use its callbacks
+ * to manage memory, passing them the `user` data pointer. Passing a ``NULL``
+ * allocator makes them use :c:data:`hipack_alloc` instead.
+ *
+ * Values must be freed using the same allocator used to create them.
+ * Dictionaries keep a pointer to their allocator, which must remain valid
+ * until the dictionary is freed.
+ *
+ * The following members must be filled in:
+ */
+typedef struct hipack_allocator {
+    /*~m void* (*alloc)(void *user, void *oldptr, size_t size)
+     * Allocation function. It must behave in the same way as
+     * :c:data:`hipack_alloc` does when `size` is non-zero, which is always
+     * the case. Memory must be aligned to at least eight bytes, as returned
+     * by ``malloc()``.
+     */
+    void* (*alloc) (void*, void*, size_t);
+
+    /*~m void (*free)(void *user, void *ptr)
+     * Frees memory obtained from `alloc`. The `ptr` passed is never
+     * ``NULL``.
+     */
+    void (*free) (void*, void*);
+
+    /*~m void *user
+     * Data passed to the allocation functions.
+     */
+    void *user;
+} hipack_allocator_t;
+
+/*~f void* hipack_allocator_alloc (const hipack_allocator_t *allocator, void *oldptr, size_t size)
+ *
+ * Allocates or reallocates memory using an `allocator`, or using
+ * :c:data:`hipack_alloc` if the `allocator` is ``NULL``.
+ */
+static inline void*
+hipack_allocator_alloc (const hipack_allocator_t *allocator,
+                        void                     *optr,
+                        size_t                    size)
+{
+    assert (size > 0);
+    return allocator ? (*allocator->alloc) (allocator->user, optr, size)
+                     : (*hipack_alloc) (optr, size);
+}
+
+/*~f void hipack_allocator_free (const hipack_allocator_t *allocator, void *pointer)
+ *
+ * Frees memory using an `allocator`, or using :c:data:`hipack_alloc` if
+ * the `allocator` is ``NULL``.
+ */
+static inline void
+hipack_allocator_free (const hipack_allocator_t *allocator,
+                       void                     *optr)
+{
+    if (!allocator)
+        (*hipack_alloc) (optr, 0);
+    else if (optr)
+        (*allocator->free) (allocator->user, optr);
+}
+
+/*~f void* hipack_allocator_alloc_array_extra (const hipack_allocator_t *allocator, void *oldptr, size_t nmemb, size_t size, size_t extra)
+ *
+ * Same as :c:func:`hipack_alloc_array_extra()`, using an `allocator`.
+ */
+extern void* hipack_allocator_alloc_array_extra (const hipack_allocator_t *allocator,
+                                                 void                     *optr,
+                                                 size_t                    nmemb,
+                                                 size_t                    size,
+                                                 size_t                    extra);
+
 
 /**
  * String Functions
@@ -207,7 +305,9 @@ hipack_alloc_free (void *optr)
  * .. note:: The hash function used by :c:func:`hipack_string_hash()` is
  *    *not* guaranteed to be cryptographically safe. Please do avoid exposing
  *    values returned by this function to the attack surface of your
- *    applications, in particular *do not expose them to the network*.
+ *    applications, in particular *do not expose them to the network*. When
+ *    parsing untrusted input, consider using a random seed, see
+ *    :c:func:`hipack_string_hash_set_seed()`.
  */
 
 /*~f hipack_string_t* hipack_string_copy (const hipack_string_t *hstr)
@@ -218,6 +318,16 @@ hipack_alloc_free (void *optr)
  */
 extern hipack_string_t* hipack_string_copy (const hipack_string_t *hstr);
 
+/*~f hipack_string_t* hipack_string_copy_with_allocator (const hipack_allocator_t *allocator, const hipack_string_t *hstr)
+ *
+ * Returns a new copy of a string, allocated using an `allocator`.
+ *
+ * The returned value must be freed using
+ * :c:func:`hipack_string_free_with_allocator()`.
+ */
+extern hipack_string_t* hipack_string_copy_with_allocator (const hipack_allocator_t *allocator,
+                                                           const hipack_string_t    *hstr);
+
 /*~f hipack_string_t* hipack_string_new_from_string (const char *str)
  *
  * Creates a new string from a C-style zero terminated string.
@@ -234,12 +344,46 @@ extern hipack_string_t* hipack_string_new_from_string (const char *str);
  */
 extern hipack_string_t* hipack_string_new_from_lstring (const char *str, uint32_t len);
 
+/*~f hipack_string_t* hipack_string_new_from_lstring_with_allocator (const hipack_allocator_t *allocator, const char *str, uint32_t len)
+ *
+ * Creates a new string from a memory area and its length, allocated using
+ * an `allocator`.
+ *
+ * The returned value must be freed using
+ * :c:func:`hipack_string_free_with_allocator()`.
+ */
+extern hipack_string_t* hipack_string_new_from_lstring_with_allocator (const hipack_allocator_t *allocator,
+                                                                       const char               *str,
+                                                                       uint32_t                  len);
+
 /*~f uint32_t hipack_string_hash (const hipack_string_t *hstr)
  *
  * Calculates a hash value for a string.
  */
 extern uint32_t hipack_string_hash (const hipack_string_t *hstr);
 
+/*~f uint32_t hipack_lstring_hash (const char *str, uint32_t len)
+ *
+ * Calculates a hash value for a memory area and its length. The result is
+ * the same as for a :c:type:`hipack_string_t` with the same contents.
+ */
+extern uint32_t hipack_lstring_hash (const char *str, uint32_t len);
+
+/*~f void hipack_string_hash_set_seed (uint64_t seed)
+ *
+ * Sets the seed used by :c:func:`hipack_string_hash()`. The default seed
+ * is zero, which makes hash values the same for every process.
+ *
+ * Using a random seed (e.g. obtained from ``/dev/urandom``) makes it hard
+ * to craft input in which many dictionary keys have the same hash value,
+ * which would make dictionary operations slow.
+ *
+ * .. warning:: The seed must be set before creating any dictionary, and
+ *    must not be changed afterwards: dictionaries created with a different
+ *    seed would not find the elements stored in them.
+ */
+extern void hipack_string_hash_set_seed (uint64_t seed);
+
 /*~f bool hipack_string_equal (const hipack_string_t *hstr1, const hipack_string_t *hstr2)
  * Compares two strings to check whether their contents are the same.
  */
@@ -251,6 +395,13 @@ extern bool hipack_string_equal (const hipack_string_t *hstr1,
  */
 extern void hipack_string_free (hipack_string_t *hstr);
 
+/*~f void hipack_string_free_with_allocator (const hipack_allocator_t *allocator, hipack_string_t *hstr)
+ * Frees the memory used by a string, using the `allocator` it was created
+ * with.
+ */
+extern void hipack_string_free_with_allocator (const hipack_allocator_t *allocator,
+                                               hipack_string_t          *hstr);
+
 
 /**
  * List Functions
@@ -262,11 +413,24 @@ extern void hipack_string_free (hipack_string_t *hstr);
  */
 extern hipack_list_t* hipack_list_new (uint32_t size);
 
+/*~f hipack_list_t* hipack_list_new_with_allocator (const hipack_allocator_t *allocator, uint32_t size)
+ * Creates a new list for ``size`` elements, allocated using an `allocator`.
+ */
+extern hipack_list_t* hipack_list_new_with_allocator (const hipack_allocator_t *allocator,
+                                                      uint32_t                  size);
+
 /*~f void hipack_list_free (hipack_list_t *list)
  * Frees the memory used by a list.
  */
 extern void hipack_list_free (hipack_list_t *list);
 
+/*~f void hipack_list_free_with_allocator (const hipack_allocator_t *allocator, hipack_list_t *list)
+ * Frees the memory used by a list, using the `allocator` it was created
+ * with. The same allocator is used to free the elements of the list.
+ */
+extern void hipack_list_free_with_allocator (const hipack_allocator_t *allocator,
+                                             hipack_list_t            *list);
+
 /*~f bool hipack_list_equal (const hipack_list_t *a, const hipack_list_t *b)
  * Checks whether two lists contains the same values.
  */
@@ -296,6 +460,14 @@ hipack_list_size (const hipack_list_t *list)
  *
  * Dictionary Functions
  * ====================
+ *
+ * Functions which take a ``const hipack_dict_t*`` never modify the
+ * dictionary: :c:func:`hipack_dict_get()`, :c:func:`hipack_dict_first()`,
+ * :c:func:`hipack_dict_next()`, and :c:macro:`HIPACK_DICT_FOREACH()` can
+ * be used on the same dictionary from multiple threads at the same time,
+ * without locking, as long as no thread modifies it. This also applies to
+ * messages returned by :c:func:`hipack_read()`, which can be shared by
+ * threads once parsed.
  */
 
 /*~f uint32_t hipack_dict_size (const hipack_dict_t *dict)
@@ -315,9 +487,42 @@ hipack_dict_size (const hipack_dict_t *dict)
  */
 extern hipack_dict_t* hipack_dict_new (void);
 
+/*~f hipack_dict_t* hipack_dict_new_with_allocator (const hipack_allocator_t *allocator)
+ *
+ * Creates a new, empty dictionary which uses an `allocator`.
+ *
+ * The dictionary keeps a pointer to the `allocator`, and uses it for all
+ * its memory allocations. Keys and values stored in the dictionary are
+ * freed using the same allocator.
+ */
+extern hipack_dict_t* hipack_dict_new_with_allocator (const hipack_allocator_t *allocator);
+
+/*~f hipack_dict_t* hipack_dict_new_with_capacity (uint32_t capacity)
+ *
+ * Creates a new, empty dictionary which can hold at least `capacity`
+ * elements without needing to grow.
+ *
+ * To create a dictionary with a given capacity which uses an allocator,
+ * use :c:func:`hipack_dict_new_with_allocator()` followed by
+ * :c:func:`hipack_dict_reserve()`.
+ */
+extern hipack_dict_t* hipack_dict_new_with_capacity (uint32_t capacity);
+
+/*~f void hipack_dict_reserve (hipack_dict_t *dict, uint32_t capacity)
+ *
+ * Ensures that a dictionary can hold at least `capacity` elements without
+ * needing to grow. This is useful to avoid growing a dictionary repeatedly
+ * when the number of elements to be added is known in advance.
+ *
+ * Note that if the dictionary needs to grow, pointers to its values
+ * obtained before calling this function are no longer valid.
+ */
+extern void hipack_dict_reserve (hipack_dict_t *dict, uint32_t capacity);
+
 /*~f void hipack_dict_free (hipack_dict_t *dict)
  *
- * Frees the memory used by a dictionary.
+ * Frees the memory used by a dictionary, using the allocator which was
+ * passed to :c:func:`hipack_dict_new_with_allocator()`, if any.
  */
 extern void hipack_dict_free (hipack_dict_t *dict);
 
@@ -329,13 +534,47 @@ extern void hipack_dict_free (hipack_dict_t *dict);
 extern bool hipack_dict_equal (const hipack_dict_t *a,
                                const hipack_dict_t *b);
 
+/*~f void hipack_dict_freeze (hipack_dict_t *dict)
+ *
+ * Converts a dictionary, and all the dictionaries contained in its values,
+ * into a read-only compact representation: elements and keys are stored in
+ * a single memory block, and a perfect hash function is used to find keys,
+ * which makes lookups examine at most one element.
+ *
+ * Frozen dictionaries can be used with all the functions which do not
+ * modify a dictionary, including :c:func:`hipack_dict_get()` and
+ * :c:macro:`HIPACK_DICT_FOREACH()`, and values can still be modified
+ * in-place. Adding or removing elements is not allowed, and calling
+ * :c:func:`hipack_dict_set()`, :c:func:`hipack_dict_set_adopt_key()`,
+ * :c:func:`hipack_dict_del()`, or :c:func:`hipack_dict_reserve()` on a
+ * frozen dictionary triggers an assertion, or does nothing if assertions
+ * are disabled.
+ *
+ * Freezing a dictionary invalidates pointers to its values and keys.
+ */
+extern void hipack_dict_freeze (hipack_dict_t *dict);
+
+/*~f bool hipack_dict_is_frozen (const hipack_dict_t *dict)
+ *
+ * Checks whether a dictionary has been frozen using
+ * :c:func:`hipack_dict_freeze()`.
+ */
+static inline bool
+hipack_dict_is_frozen (const hipack_dict_t *dict)
+{
+    assert (dict);
+    return dict->frozen;
+}
+
 /*~f void hipack_dict_set (hipack_dict_t *dict, const hipack_string_t *key, const hipack_value_t *value)
  *
  * Adds an association of a `key` to a `value`.
  *
  * Note that this function will copy the `key`. If you are not planning to
  * continue reusing the `key`, it is recommended to use
- * :c:func:`hipack_dict_set_adopt_key()` instead.
+ * :c:func:`hipack_dict_set_adopt_key()` instead. Keys of up to
+ * :c:macro:`HIPACK_DICT_INLINE_KEY_SIZE` bytes are copied into the
+ * dictionary without allocating memory.
  */
 extern void hipack_dict_set (hipack_dict_t         *dict,
                              const hipack_string_t *key,
@@ -345,15 +584,30 @@ extern void hipack_dict_set (hipack_dict_t         *dict,
  *
  * Adds an association of a `key` to a `value`, passing ownership of the
  * memory using by the `key` to the dictionary (i.e. the string used as key
- * will be freed by the dictionary).
+ * will be freed by the dictionary). The `key` must have been created using
+ * the same allocator as the dictionary.
  *
  * Use this function instead of :c:func:`hipack_dict_set()` when the `key`
- * is not going to be used further afterwards.
+ * is not going to be used further afterwards. Short keys are copied into
+ * the dictionary, and freed right away.
  */
 extern void hipack_dict_set_adopt_key (hipack_dict_t        *dict,
                                        hipack_string_t     **key,
                                        const hipack_value_t *value);
 
+/*~f void hipack_dict_set_borrowed_key (hipack_dict_t *dict, const hipack_string_t *key, const hipack_value_t *value)
+ *
+ * Adds an association of a `key` to a `value`, without copying the `key`
+ * and without taking ownership of it: the dictionary will not free the
+ * `key`, which must remain valid for as long as the dictionary contains
+ * it. This is typically used with keys obtained from an intern pool (see
+ * :c:func:`hipack_intern()`), which makes lookups using the same pointer
+ * for the key faster. Short keys are copied into the dictionary anyway.
+ */
+extern void hipack_dict_set_borrowed_key (hipack_dict_t         *dict,
+                                          const hipack_string_t *key,
+                                          const hipack_value_t  *value);
+
 /*~f void hipack_dict_del (hipack_dict_t *dict, const hipack_string_t *key)
  *
  * Removes the element from a dictionary associated to a `key`.
@@ -361,20 +615,73 @@ extern void hipack_dict_set_adopt_key (hipack_dict_t        *dict,
 extern void hipack_dict_del (hipack_dict_t         *dict,
                              const hipack_string_t *key);
 
+/*~f void hipack_dict_del_lstring (hipack_dict_t *dict, const char *str, uint32_t len)
+ *
+ * Removes the element from a dictionary associated to a key, given as a
+ * memory area and its length.
+ */
+extern void hipack_dict_del_lstring (hipack_dict_t *dict,
+                                     const char    *str,
+                                     uint32_t       len);
+
+/*~f void hipack_dict_del_string (hipack_dict_t *dict, const char *str)
+ *
+ * Removes the element from a dictionary associated to a key, given as a
+ * C-style zero terminated string.
+ */
+static inline void
+hipack_dict_del_string (hipack_dict_t *dict,
+                        const char    *str)
+{
+    assert (str);
+    hipack_dict_del_lstring (dict, str, strlen (str));
+}
+
 /*~f hipack_value_t* hipack_dict_get (const hipack_dict_t *dict, const hipack_string_t *key)
  *
  * Obtains the value associated to a `key` from a dictionary.
  *
  * The returned value points to memory owned by the dictionary. The value can
- * be modified in-place, but it shall not be freed.
+ * be modified in-place, but it shall not be freed. The pointer is valid
+ * until the dictionary is modified by adding or removing elements.
  */
 extern hipack_value_t* hipack_dict_get (const hipack_dict_t   *dict,
                                         const hipack_string_t *key);
 
+/*~f hipack_value_t* hipack_dict_get_lstring (const hipack_dict_t *dict, const char *str, uint32_t len)
+ *
+ * Obtains the value associated to a key, given as a memory area and its
+ * length, from a dictionary. This avoids creating a
+ * :c:type:`hipack_string_t` to look up a key.
+ *
+ * The returned value follows the same rules as for
+ * :c:func:`hipack_dict_get()`.
+ */
+extern hipack_value_t* hipack_dict_get_lstring (const hipack_dict_t *dict,
+                                                const char          *str,
+                                                uint32_t             len);
+
+/*~f hipack_value_t* hipack_dict_get_string (const hipack_dict_t *dict, const char *str)
+ *
+ * Obtains the value associated to a key, given as a C-style zero
+ * terminated string, from a dictionary.
+ *
+ * The returned value follows the same rules as for
+ * :c:func:`hipack_dict_get()`.
+ */
+static inline hipack_value_t*
+hipack_dict_get_string (const hipack_dict_t *dict,
+                        const char          *str)
+{
+    assert (str);
+    return hipack_dict_get_lstring (dict, str, strlen (str));
+}
+
 /*~f hipack_value_t* hipack_dict_first (const hipack_dict_t *dict, const hipack_string_t **key)
  *
  * Obtains an a *(key, value)* pair, which is considered the *first* in
- * iteration order. This can be used in combination with
+ * iteration order. Dictionaries are iterated in the order in which their
+ * elements were added. This can be used in combination with
  * :c:func:`hipack_dict_next()` to enumerate all the *(key, value)* pairs
  * stored in the dictionary:
  *
@@ -390,6 +697,10 @@ extern hipack_value_t* hipack_dict_get (const hipack_dict_t   *dict,
  *        // Use "k" and "v" normally.
  *    }
  *
+ * Short keys are stored in the dictionary entries, so like values, the
+ * keys are valid until the dictionary is modified by adding or removing
+ * elements.
+ *
  * As a shorthand, consider using :c:macro:`HIPACK_DICT_FOREACH()` instead.
  */
 extern hipack_value_t* hipack_dict_first (const hipack_dict_t    *dict,
@@ -426,6 +737,50 @@ extern hipack_value_t* hipack_dict_next (hipack_value_t         *value,
          (_v) != NULL;                           \
          (_v) = hipack_dict_next ((_v), &(_k)))
 
+/**
+ * Key Interning
+ * =============
+ *
+ * Intern pools keep a single copy of each distinct string added to them.
+ * Using a pool with the parser (see :c:member:`hipack_reader_t.intern`)
+ * makes the keys of all the parsed messages be shared instead of being
+ * allocated for every message, which greatly reduces memory usage when
+ * many messages use the same keys.
+ *
+ * Strings are kept in the pool until it is freed, so pools should not be
+ * used to parse untrusted input with an unbounded number of distinct keys.
+ * Pools are not thread-safe.
+ */
+
+/*~t hipack_intern_t
+ *
+ * Opaque type of string intern pools.
+ */
+typedef struct hipack_intern hipack_intern_t;
+
+/*~f hipack_intern_t* hipack_intern_new (void)
+ *
+ * Creates a new, empty intern pool.
+ */
+extern hipack_intern_t* hipack_intern_new (void);
+
+/*~f void hipack_intern_free (hipack_intern_t *pool)
+ *
+ * Frees an intern pool and all the strings it contains. Dictionaries which
+ * use strings from the pool as keys must be freed before the pool.
+ */
+extern void hipack_intern_free (hipack_intern_t *pool);
+
+/*~f const hipack_string_t* hipack_intern (hipack_intern_t *pool, const hipack_string_t *str)
+ *
+ * Obtains the copy of a string stored in an intern `pool`, adding a copy
+ * of `str` to the pool if needed. The returned string is owned by the
+ * pool, and must not be freed.
+ */
+extern const hipack_string_t* hipack_intern (hipack_intern_t       *pool,
+                                             const hipack_string_t *str);
+
+
 /**
  * Value Functions
  * ===============
@@ -438,10 +793,21 @@ extern hipack_value_t* hipack_dict_next (hipack_value_t         *value,
 static inline hipack_type_t
 hipack_value_type (const hipack_value_t *value)
 {
-    return value->type;
+    return (hipack_type_t) (value->tag & HIPACK_VALUE_TYPE_MASK);
+}
+
+/*~f hipack_annot_t* hipack_value_annot (const hipack_value_t *value)
+ *
+ * Obtains the annotations of a value, or ``NULL`` if the value has no
+ * annotations. Use :c:macro:`HIPACK_ANNOT_FOREACH()` to enumerate them.
+ */
+static inline hipack_annot_t*
+hipack_value_annot (const hipack_value_t *value)
+{
+    return (hipack_annot_t*) (value->tag & ~HIPACK_VALUE_TYPE_MASK);
 }
 
-/*~f hipack_value_t hipack_integer (int32_t value)
+/*~f hipack_value_t hipack_integer (int64_t value)
  * Creates a new integer value.
  */
 /*~f hipack_value_t hipack_float (double value)
@@ -479,8 +845,8 @@ hipack_value_type (const hipack_value_t *value)
  * Checks whether a value is a dictionary.
  */
 
-/*~f const int32_t hipack_value_get_integer (const hipack_value_t *value)
- * Obtains a numeric value as an ``int32_t``.
+/*~f const int64_t hipack_value_get_integer (const hipack_value_t *value)
+ * Obtains a numeric value as an ``int64_t``.
  */
 /*~f const double hipack_value_get_float (const hipack_value_t *value)
  * Obtains a floating point value as a ``double``.
@@ -499,7 +865,7 @@ hipack_value_type (const hipack_value_t *value)
  */
 
 #define HIPACK_TYPES(F) \
-    F (int32_t,          integer, HIPACK_INTEGER) \
+    F (int64_t,          integer, HIPACK_INTEGER) \
     F (double,           float,   HIPACK_FLOAT  ) \
     F (bool,             bool,    HIPACK_BOOL   ) \
     F (hipack_string_t*, string,  HIPACK_STRING ) \
@@ -509,20 +875,20 @@ hipack_value_type (const hipack_value_t *value)
 #define HIPACK_DEFINE_IS_TYPE(_type, name, type_tag)          \
     static inline bool                                        \
     hipack_value_is_ ## name (const hipack_value_t *value) {  \
-        return value->type == type_tag;                       \
+        return hipack_value_type (value) == type_tag;         \
     }
 
 #define HIPACK_DEFINE_GET_VALUE(_type, name, type_tag)        \
     static inline const _type                                 \
     hipack_value_get_ ## name (const hipack_value_t *value) { \
-        assert (value->type == type_tag);                     \
+        assert (hipack_value_type (value) == type_tag);       \
         return value->v_ ## name;                             \
     }
 
 #define HIPACK_DEFINE_MAKE_VALUE(_type, name, type_tag)                 \
     static inline hipack_value_t                                        \
     hipack_ ## name (_type value) {                                     \
-        hipack_value_t v = { type_tag, NULL, { .v_ ## name = value } }; \
+        hipack_value_t v = { { .v_ ## name = value }, type_tag };       \
         return v;                                                       \
     }
 
@@ -542,19 +908,28 @@ HIPACK_TYPES (HIPACK_DEFINE_MAKE_VALUE)
 extern bool hipack_value_equal (const hipack_value_t *a,
                                 const hipack_value_t *b);
 
-/*~f void hipack_value_free (hipack_value_t *value)
+/*~f void hipack_annot_free (hipack_annot_t *annot)
  *
- * Frees the memory used by a value.
+ * Frees the memory used to store the annotations of a value. This is used
+ * by :c:func:`hipack_value_free()`, and usually there is no need to call
+ * it directly.
+ */
+extern void hipack_annot_free (hipack_annot_t *annot);
+
+/*~f void hipack_value_free_with_allocator (const hipack_allocator_t *allocator, hipack_value_t *value)
+ *
+ * Frees the memory used by a value, using the `allocator` it was created
+ * with. Dictionaries are always freed using their own allocator.
  */
 static inline void
-hipack_value_free (hipack_value_t *value)
+hipack_value_free_with_allocator (const hipack_allocator_t *allocator,
+                                  hipack_value_t           *value)
 {
     assert (value);
 
-    if (value->annot)
-        hipack_dict_free (value->annot);
+    hipack_annot_free (hipack_value_annot (value));
 
-    switch (value->type) {
+    switch (hipack_value_type (value)) {
         case HIPACK_INTEGER:
         case HIPACK_FLOAT:
         case HIPACK_BOOL:
@@ -562,11 +937,11 @@ hipack_value_free (hipack_value_t *value)
             break;
 
         case HIPACK_STRING:
-            hipack_string_free (value->v_string);
+            hipack_string_free_with_allocator (allocator, value->v_string);
             break;
 
         case HIPACK_LIST:
-            hipack_list_free (value->v_list);
+            hipack_list_free_with_allocator (allocator, value->v_list);
             break;
 
         case HIPACK_DICT:
@@ -575,65 +950,131 @@ hipack_value_free (hipack_value_t *value)
     }
 }
 
-/*~f void hipack_value_add_annot (hipack_value_t *value, const char *annot)
+/*~f void hipack_value_free (hipack_value_t *value)
  *
- * Adds an annotation to a value. If the value already had the annotation,
- * this function is a no-op.
+ * Frees the memory used by a value.
  */
 static inline void
-hipack_value_add_annot (hipack_value_t *value,
-                        const char     *annot)
+hipack_value_free (hipack_value_t *value)
 {
-    assert (value);
-    assert (annot);
+    hipack_value_free_with_allocator (NULL, value);
+}
 
-    if (!value->annot) {
-        value->annot = hipack_dict_new ();
-    }
+/*~f void hipack_value_add_annot (hipack_value_t *value, const char *annot)
+ *
+ * Adds an annotation to a value. If the value already had the annotation,
+ * this function is a no-op.
+ */
+extern void hipack_value_add_annot (hipack_value_t *value,
+                                    const char     *annot);
 
-    static const hipack_value_t bool_true = {
-        .type   = HIPACK_BOOL,
-        .v_bool = true,
-    };
-    hipack_string_t *key = hipack_string_new_from_string (annot);
-    hipack_dict_set_adopt_key (value->annot, &key, &bool_true);
-}
+/*~f bool hipack_value_add_annot_lstring_with_allocator (const hipack_allocator_t *allocator, hipack_value_t *value, const char *annot, uint32_t length)
+ *
+ * Adds an annotation of `length` bytes to a value, and returns whether it
+ * was added: if the value already had the annotation, ``false`` is
+ * returned. The annotations of a value are stored in a single block of
+ * memory, which is allocated using `allocator` when the first annotation
+ * is added, and only grown when it runs out of space.
+ */
+extern bool hipack_value_add_annot_lstring_with_allocator (const hipack_allocator_t *allocator,
+                                                           hipack_value_t           *value,
+                                                           const char               *annot,
+                                                           uint32_t                  length);
 
 /*~f bool hipack_value_has_annot (const hipack_value_t *value, const char *annot)
  *
  * Checks whether a value has a given annotation.
  */
-static inline bool
-hipack_value_has_annot (const hipack_value_t *value,
-                        const char           *annot)
-{
-    assert (value);
-    assert (annot);
-
-    /* TODO: Try to avoid the string copy. */
-    hipack_string_t *key = hipack_string_new_from_string (annot);
-    bool result = (value->annot) && hipack_dict_get (value->annot, key);
-    hipack_string_free (key);
-    return result;
-}
+extern bool hipack_value_has_annot (const hipack_value_t *value,
+                                    const char           *annot);
 
 /*~f void hipack_value_del_annot (hipack_value_t *value, const char *annot)
  *
  * Removes an annotation from a value. If the annotation was not present, this
- * function is a no-op.
+ * function is a no-op. The memory used to store annotations is released
+ * when the last one is removed.
  */
-static inline void
-hipack_value_del_annot (hipack_value_t *value,
-                        const char     *annot)
-{
-    assert (value);
-    assert (annot);
+extern void hipack_value_del_annot (hipack_value_t *value,
+                                    const char     *annot);
 
-    if (value->annot) {
-        hipack_string_t *key = hipack_string_new_from_string (annot);
-        hipack_dict_del (value->annot, key);
-    }
-}
+/*~f const hipack_string_t* hipack_value_annot_next (const hipack_value_t *value, const hipack_string_t *annot)
+ *
+ * Obtains the annotation of a value which follows `annot`, or the first
+ * one if `annot` is ``NULL``. Annotations are returned in the order in
+ * which they were added, and ``NULL`` is returned after the last one.
+ * Adding or removing annotations invalidates the returned pointers.
+ *
+ * As a shorthand, consider using :c:macro:`HIPACK_ANNOT_FOREACH()` instead.
+ */
+extern const hipack_string_t* hipack_value_annot_next (const hipack_value_t  *value,
+                                                       const hipack_string_t *annot);
+
+/*~M HIPACK_ANNOT_FOREACH(value, annot)
+ *
+ * Convenience macro used to iterate over the annotations of a value.
+ * Internally this uses :c:func:`hipack_value_annot_next()`.
+ *
+ * .. code-block:: c
+ *
+ *    const hipack_string_t *annot;
+ *    HIPACK_ANNOT_FOREACH (value, annot) {
+ *        // Use "annot"
+ *    }
+ */
+#define HIPACK_ANNOT_FOREACH(_v, _a)                     \
+    for ((_a) = hipack_value_annot_next ((_v), NULL);   \
+         (_a) != NULL;                                  \
+         (_a) = hipack_value_annot_next ((_v), (_a)))
+
+
+/*~t hipack_arena_t
+ *
+ * Memory arena. Memory is obtained from the arena in small chunks, which
+ * are carved out of bigger blocks, and the whole arena is released at once
+ * using :c:func:`hipack_arena_free()`.
+ *
+ * Passing the allocator of an arena (see :c:func:`hipack_arena_allocator()`)
+ * to the parser makes it allocate all the values of a message from the
+ * arena, which is considerably faster than using :c:data:`hipack_alloc`.
+ */
+typedef struct hipack_arena hipack_arena_t;
+
+/*~f hipack_arena_t* hipack_arena_new (size_t block_size)
+ *
+ * Creates a new memory arena which allocates memory in blocks of
+ * `block_size` bytes. Passing zero uses a sensible default block size.
+ *
+ * Blocks are allocated using :c:data:`hipack_alloc`, as it is set at the
+ * moment the arena is created.
+ */
+extern hipack_arena_t* hipack_arena_new (size_t block_size);
+
+/*~f void hipack_arena_free (hipack_arena_t *arena)
+ *
+ * Frees a memory arena, along with all the memory allocated from it.
+ */
+extern void hipack_arena_free (hipack_arena_t *arena);
+
+/*~f void* hipack_arena_alloc (hipack_arena_t *arena, void *oldptr, size_t size)
+ *
+ * Allocation function which obtains memory from an `arena`. The behaviour
+ * is the same as described for :c:data:`hipack_alloc`, with the difference
+ * that freeing memory does not return it to the system, but it is instead
+ * released by :c:func:`hipack_arena_free()`.
+ */
+extern void* hipack_arena_alloc (hipack_arena_t *arena,
+                                 void           *oldptr,
+                                 size_t          size);
+
+/*~f const hipack_allocator_t* hipack_arena_allocator (hipack_arena_t *arena)
+ *
+ * Obtains an allocator which uses :c:func:`hipack_arena_alloc()` to obtain
+ * memory from an `arena`. The allocator is valid until the arena is freed.
+ *
+ * Values created using an arena allocator do not need to be freed: their
+ * memory is released when passing the arena to :c:func:`hipack_arena_free()`.
+ */
+extern const hipack_allocator_t* hipack_arena_allocator (hipack_arena_t *arena);
 
 
 /**
@@ -654,6 +1095,8 @@ typedef struct {
      * next character of input is needed. It must return it as an integer,
      * :any:`HIPACK_IO_EOF` when trying to read pas the end of the input,
      * or :any:`HIPACK_IO_ERROR` if an input error occurs.
+     *
+     * This callback is only used if `read` is ``NULL``.
      */
     int (*getchar) (void*);
 
@@ -677,6 +1120,48 @@ typedef struct {
      * On error, the column where parsing was stopped.
      */
     unsigned error_column;
+
+    /*~m int (*read)(void *data, uint8_t *buffer, size_t size)
+     * Block reader callback function. The function will be called every
+     * time the parser runs out of buffered input, and it must store at most
+     * `size` bytes of input into `buffer`. It must return the number of
+     * bytes stored, either ``0`` or :any:`HIPACK_IO_EOF` when trying to
+     * read past the end of the input, or :any:`HIPACK_IO_ERROR` if an input
+     * error occurs.
+     *
+     * Reading input in blocks avoids calling a function for each character
+     * of input, and it is the preferred way of feeding data to the parser.
+     * When set, `getchar` is ignored.
+     */
+    int (*read) (void*, uint8_t*, size_t);
+
+    /*~m void *read_data
+     * Data passed to the block reader callback function.
+     */
+    void *read_data;
+
+    /*~m const hipack_allocator_t *allocator
+     * Allocator used to create the values of the parsed message. When
+     * ``NULL`` (the default), :c:data:`hipack_alloc` is used.
+     *
+     * Using the allocator of an arena (see :c:func:`hipack_arena_allocator()`)
+     * makes parsing considerably faster. In that case the memory for the
+     * parsed message is released by passing the arena to
+     * :c:func:`hipack_arena_free()`, instead of using
+     * :c:func:`hipack_dict_free()`.
+     */
+    const hipack_allocator_t *allocator;
+
+    /*~m hipack_intern_t *intern
+     * Intern pool used for dictionary keys. When ``NULL`` (the default),
+     * each key of the parsed message is allocated separately.
+     *
+     * When set, keys are obtained using :c:func:`hipack_intern()` and
+     * added to dictionaries using :c:func:`hipack_dict_set_borrowed_key()`,
+     * so parsing does not allocate memory for keys already in the pool. The
+     * pool must be freed after all the messages parsed using it.
+     */
+    hipack_intern_t *intern;
 } hipack_reader_t;
 
 
@@ -714,6 +1199,39 @@ extern const char* HIPACK_READ_ERROR;
  */
 extern hipack_dict_t* hipack_read (hipack_reader_t *reader);
 
+/*~f hipack_dict_t* hipack_read_buffer (const uint8_t *data, size_t length, hipack_reader_t *reader)
+ *
+ * Reads a HiPack message from a memory area of `length` bytes starting at
+ * `data`, and returns a dictionary.
+ *
+ * The parser scans the memory area directly, so this is the fastest way
+ * of parsing messages which are already in memory. The callbacks of the
+ * `reader` are not used, and otherwise it is used in the same way as
+ * :c:func:`hipack_read()` does.
+ */
+extern hipack_dict_t* hipack_read_buffer (const uint8_t   *data,
+                                          size_t           length,
+                                          hipack_reader_t *reader);
+
+/*~f hipack_dict_t* hipack_read_file (const char *path, hipack_reader_t *reader)
+ *
+ * Reads a HiPack message from the file at `path`, and returns a dictionary.
+ *
+ * Regular files are mapped in memory and parsed in place, which avoids
+ * copying their contents. Other kinds of files, like pipes, are read in
+ * blocks using their file descriptor.
+ *
+ * As with :c:func:`hipack_read_buffer()`, the callbacks of the `reader` are
+ * not used. If the file cannot be opened or read, its `error` member is set
+ * to :any:`HIPACK_READ_ERROR`, and the cause of the error can be obtained
+ * from ``errno``.
+ *
+ * Note that the contents of a mapped file must not be truncated while the
+ * message is being read.
+ */
+extern hipack_dict_t* hipack_read_file (const char      *path,
+                                        hipack_reader_t *reader);
+
 /*~f int hipack_stdio_getchar (void* fp)
  *
  * Reader function which uses ``FILE*`` objects from the standard C library.
@@ -735,6 +1253,27 @@ extern hipack_dict_t* hipack_read (hipack_reader_t *reader);
  */
 extern int hipack_stdio_getchar (void* fp);
 
+/*~f int hipack_stdio_read (void* fp, uint8_t *buffer, size_t size)
+ *
+ * Block reader function which uses ``FILE*`` objects from the standard C
+ * library. This is equivalent to :c:func:`hipack_stdio_getchar()`, but
+ * reads input in blocks, which is considerably faster:
+ *
+ * .. code-block:: c
+ *
+ *    FILE* stream = fopen (HIPACK_FILE_PATH, "rb")
+ *    hipack_reader_t reader = {
+ *        .read = hipack_stdio_read,
+ *        .read_data = stream,
+ *    };
+ *    hipack_dict_t *message = hipack_read (&reader);
+ *
+ * Note that the parser may consume more input than the message itself,
+ * so the position of the ``FILE*`` after reading is unspecified. The user
+ * is responsible for closing the ``FILE*`` after using it.
+ */
+extern int hipack_stdio_read (void* fp, uint8_t *buffer, size_t size);
+
 
 /**
  * Writer Interface
@@ -755,6 +1294,8 @@ typedef struct {
      * if an output error occurs, and it is invalid for the callback to
      * return :any:`HIPACK_IO_EOF`. Any other value is interpreted as
      * indication of success.
+     *
+     * This callback is only used if `write` is ``NULL``.
      */
     int (*putchar) (void*, int);
 
@@ -767,6 +1308,28 @@ typedef struct {
      * Either :any:`HIPACK_WRITER_COMPACT` or :any:`HIPACK_WRITER_INDENTED`.
      */
     int32_t indent;
+
+    /*~m int (*write)(void *data, const uint8_t *buffer, size_t size)
+     * Block writer callback function. When set, output is gathered in a
+     * buffer and the function is called each time the buffer is full, and
+     * before the writing function used returns. It must write all the
+     * `size` bytes from `buffer`, and return :any:`HIPACK_IO_ERROR` if an
+     * output error occurs. Any other value is interpreted as indication
+     * of success.
+     *
+     * Writing output in blocks avoids calling a function for each character
+     * of output, and it is the preferred way of producing output. When set,
+     * `putchar` is ignored.
+     */
+    int (*write) (void*, const uint8_t*, size_t);
+
+    /*~m void *write_data
+     * Data passed to the block writer callback function.
+     */
+    void *write_data;
+
+    uint8_t *buffer;      /* Output buffer, while writing. */
+    uint32_t buffer_used; /* Bytes used in the output buffer. */
 } hipack_writer_t;
 
 
@@ -801,6 +1364,35 @@ extern bool hipack_write_value (hipack_writer_t      *writer,
 extern bool hipack_write (hipack_writer_t     *writer,
                           const hipack_dict_t *message);
 
+/*~f size_t hipack_write_size (const hipack_dict_t *message, int32_t indent)
+ *
+ * Calculates the exact amount of bytes written by :c:func:`hipack_write()`
+ * for a `message`, using either :any:`HIPACK_WRITER_COMPACT` or
+ * :any:`HIPACK_WRITER_INDENTED` as `indent`. The whole message is formatted,
+ * without storing the output.
+ */
+extern size_t hipack_write_size (const hipack_dict_t *message,
+                                 int32_t              indent);
+
+/*~f uint8_t* hipack_write_to_buffer (const hipack_dict_t *message, int32_t indent, bool exact_size, size_t *length)
+ *
+ * Writes a HiPack `message` into a newly allocated buffer, which is
+ * returned, storing the amount of bytes written in `length`. The output
+ * is followed by a nul byte, which is not included in the `length`. The
+ * buffer is allocated using :c:data:`hipack_alloc`, and the caller is
+ * responsible for freeing it with :c:func:`hipack_alloc_free()`.
+ *
+ * The buffer grows as needed while the message is written. If `exact_size`
+ * is ``true``, the size of the output is calculated beforehand using
+ * :c:func:`hipack_write_size()`, and the buffer is allocated only once.
+ * This takes more time, but it avoids copying the output around when the
+ * buffer grows, and it does not use more memory than needed.
+ */
+extern uint8_t* hipack_write_to_buffer (const hipack_dict_t *message,
+                                        int32_t              indent,
+                                        bool                 exact_size,
+                                        size_t              *length);
+
 /*~f int hipack_stdio_putchar (void* data, int ch)
  *
  * Writer function which uses ``FILE*`` objects from the standard C library.
@@ -822,4 +1414,23 @@ extern bool hipack_write (hipack_writer_t     *writer,
  */
 extern int hipack_stdio_putchar (void* fp, int ch);
 
+/*~f int hipack_stdio_write (void* fp, const uint8_t *buffer, size_t size)
+ *
+ * Block writer function which uses ``FILE*`` objects from the standard C
+ * library. This is equivalent to :c:func:`hipack_stdio_putchar()`, but
+ * it is considerably faster:
+ *
+ * .. code-block:: c
+ *
+ *    FILE* stream = fopen (HIPACK_FILE_PATH, "wb");
+ *    hipack_writer_t writer = {
+ *        .write = hipack_stdio_write,
+ *        .write_data = stream,
+ *    };
+ *    hipack_write (&writer, message);
+ *
+ * The user is responsible for closing the ``FILE*`` after using it.
+ */
+extern int hipack_stdio_write (void* fp, const uint8_t *buffer, size_t size);
+
 #endif /* !HIPACK_H */
@@ -0,0 +1,939 @@
+/*
+ * hipack-bench.c
+ * Copyright (C) 2015 Adrian Perez <aperez@igalia.com>
+ *
+ * Distributed under terms of the MIT license.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include "../hipack.h"
+#include "../hipack-float.h"
+#include <stdlib.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+
+
+#ifndef BENCH_MIN_SECONDS
+#define BENCH_MIN_SECONDS 0.5
+#endif /* !BENCH_MIN_SECONDS */
+
+#ifndef BENCH_THREADS
+#define BENCH_THREADS 8
+#endif /* !BENCH_THREADS */
+
+
+struct buffer {
+    uint8_t *data;
+    size_t   size;
+    size_t   alloc;
+};
+
+
+static void
+buffer_append (struct buffer *b, const char *fmt, ...)
+{
+    va_list args;
+    for (;;) {
+        va_start (args, fmt);
+        int n = vsnprintf ((char*) b->data + b->size, b->alloc - b->size,
+                           fmt, args);
+        va_end (args);
+        assert (n >= 0);
+
+        if ((size_t) n < b->alloc - b->size) {
+            b->size += n;
+            return;
+        }
+        b->alloc = (b->alloc + n + 1) * 2;
+        b->data = hipack_alloc_stdlib (b->data, b->alloc);
+    }
+}
+
+
+static void
+buffer_free (void *data)
+{
+    struct buffer *b = data;
+    hipack_alloc_stdlib (b->data, 0);
+    hipack_alloc_stdlib (b, 0);
+}
+
+
+static struct buffer*
+buffer_new (void)
+{
+    struct buffer *b = hipack_alloc_stdlib (NULL, sizeof (struct buffer));
+    b->alloc = 4096;
+    b->size = 0;
+    b->data = hipack_alloc_stdlib (NULL, b->alloc);
+    b->data[0] = '\0';
+    return b;
+}
+
+
+static void
+parse_buffer (void *data)
+{
+    struct buffer *b = data;
+    hipack_reader_t reader = { 0 };
+    hipack_dict_t *message = hipack_read_buffer (b->data, b->size, &reader);
+    if (!message) {
+        fprintf (stderr, "line %u, column %u: %s\n",
+                 reader.error_line, reader.error_column, reader.error);
+        abort ();
+    }
+    hipack_dict_free (message);
+}
+
+
+/* Same as parse_buffer(), allocating the parsed values from an arena. */
+static void
+parse_buffer_arena (void *data)
+{
+    struct buffer *b = data;
+    hipack_arena_t *arena = hipack_arena_new (0);
+    hipack_reader_t reader = { .allocator = hipack_arena_allocator (arena) };
+    hipack_dict_t *message = hipack_read_buffer (b->data, b->size, &reader);
+    if (!message) {
+        fprintf (stderr, "line %u, column %u: %s\n",
+                 reader.error_line, reader.error_column, reader.error);
+        abort ();
+    }
+    hipack_arena_free (arena);
+}
+
+
+static int
+buffer_read (void *data, uint8_t *buffer, size_t size)
+{
+    struct buffer *b = data;
+    if (size > b->alloc - b->size)
+        size = b->alloc - b->size;
+    memcpy (buffer, b->data + b->size, size);
+    b->size += size;
+    return size;
+}
+
+
+/* Same as parse_buffer(), feeding the input to the parser in blocks. */
+static void
+parse_blocks (void *data)
+{
+    /* Use a copy of the buffer description to keep track of the position. */
+    struct buffer input = { ((struct buffer*) data)->data, 0,
+                            ((struct buffer*) data)->size };
+    hipack_reader_t reader = {
+        .read = buffer_read,
+        .read_data = &input,
+    };
+    hipack_dict_t *message = hipack_read (&reader);
+    if (!message) {
+        fprintf (stderr, "line %u, column %u: %s\n",
+                 reader.error_line, reader.error_column, reader.error);
+        abort ();
+    }
+    hipack_dict_free (message);
+}
+
+
+/* A single string value of 1 MiB. */
+static void*
+setup_long_string (void)
+{
+    struct buffer *b = buffer_new ();
+    buffer_append (b, "text: \"");
+    for (unsigned i = 0; i < 1024 * 1024 / 64; i++)
+        buffer_append (b, "%s", "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do.");
+    buffer_append (b, "\"\n");
+    return b;
+}
+
+
+/* A single list with 100k integer elements. */
+static void*
+setup_long_list (void)
+{
+    struct buffer *b = buffer_new ();
+    buffer_append (b, "items: [");
+    for (unsigned i = 0; i < 100000; i++)
+        buffer_append (b, "%u,", i);
+    buffer_append (b, "]\n");
+    return b;
+}
+
+
+/* A list with 100k timestamps in nanoseconds, as 64-bit integers. */
+static void*
+setup_timestamps (void)
+{
+    struct buffer *b = buffer_new ();
+    buffer_append (b, "items: [");
+    for (unsigned i = 0; i < 100000; i++)
+        buffer_append (b, "%" PRId64 ",", INT64_C (1452362587000000000) + i * INT64_C (1000003));
+    buffer_append (b, "]\n");
+    return b;
+}
+
+
+/* A list with 100k integer elements, each with two annotations. */
+static void*
+setup_annotated_list (void)
+{
+    struct buffer *b = buffer_new ();
+    buffer_append (b, "items: [");
+    for (unsigned i = 0; i < 100000; i++)
+        buffer_append (b, ":unit :checked %u,", i);
+    buffer_append (b, "]\n");
+    return b;
+}
+
+
+/*
+ * Floating point values of different magnitudes, written with enough
+ * digits to be read back exactly, as most tools which save data do.
+ */
+static double
+float_value (unsigned i)
+{
+    static const double scale[] = { 1e-9, 1e-3, 1.0, 1e3, 1e6 };
+    uint32_t r = i * UINT32_C (2654435761);
+    return (r / 4294967296.0 - 0.5) * scale[i % 5];
+}
+
+
+/* A list with 100k floating point elements. */
+static void*
+setup_float_list (void)
+{
+    struct buffer *b = buffer_new ();
+    buffer_append (b, "items: [");
+    for (unsigned i = 0; i < 100000; i++)
+        buffer_append (b, "%.17g,", float_value (i));
+    buffer_append (b, "]\n");
+    return b;
+}
+
+
+/* The same numbers as setup_float_list(), separated by NUL bytes. */
+static void*
+setup_floats (void)
+{
+    struct buffer *b = buffer_new ();
+    for (unsigned i = 0; i < 100000; i++)
+        buffer_append (b, "%.17g%c", float_value (i), '\0');
+    return b;
+}
+
+
+static void
+floats_parse (void *data)
+{
+    struct buffer *b = data;
+    for (size_t offset = 0; offset < b->size;) {
+        const char *text = (const char*) b->data + offset;
+        size_t length = strlen (text);
+        double value;
+        if (!hipack_float_parse (text, length, &value))
+            abort ();
+        offset += length + 1;
+    }
+}
+
+
+static void
+floats_strtod (void *data)
+{
+    struct buffer *b = data;
+    for (size_t offset = 0; offset < b->size;) {
+        const char *text = (const char*) b->data + offset;
+        char *end;
+        strtod (text, &end);
+        if (*end != '\0')
+            abort ();
+        offset += end - text + 1;
+    }
+}
+
+
+/* A list with 100k short string elements. */
+static void*
+setup_list_strings (void)
+{
+    struct buffer *b = buffer_new ();
+    buffer_append (b, "items: [");
+    for (unsigned i = 0; i < 100000; i++)
+        buffer_append (b, "\"item %u\",", i);
+    buffer_append (b, "]\n");
+    return b;
+}
+
+
+/* Nested dictionaries with string values, like a configuration file. */
+static void*
+setup_strings_dict (void)
+{
+    struct buffer *b = buffer_new ();
+    for (unsigned i = 0; i < 1000; i++) {
+        buffer_append (b, "section_%u {\n", i);
+        for (unsigned j = 0; j < 10; j++)
+            buffer_append (b, "    entry_name_%u: \"value number %u of the "
+                           "section, with some text\"\n", j, j);
+        buffer_append (b, "}\n\n");
+    }
+    return b;
+}
+
+
+/* A small message, like those sent by a service many times. */
+static void*
+setup_small_message (void)
+{
+    struct buffer *b = buffer_new ();
+    buffer_append (b,
+                   "timestamp: 1452362587\n"
+                   "host: \"web-042.example.com\"\n"
+                   "service: \"frontend\"\n"
+                   "request {\n"
+                   "    method: \"GET\"\n"
+                   "    path: \"/api/v1/items\"\n"
+                   "    status: 200\n"
+                   "    duration_ms: 12.5\n"
+                   "}\n"
+                   "tags [\"production\", \"eu-west\"]\n"
+                   "client { address: \"192.0.2.17\", port: 49152 }\n");
+    return b;
+}
+
+
+#ifndef BENCH_MESSAGES
+#define BENCH_MESSAGES 1000
+#endif /* !BENCH_MESSAGES */
+
+static void
+parse_messages (void *data)
+{
+    for (unsigned i = 0; i < BENCH_MESSAGES; i++)
+        parse_buffer (data);
+}
+
+
+/* Same as parse_messages(), sharing the keys using an intern pool. */
+static void
+parse_messages_intern (void *data)
+{
+    struct buffer *b = data;
+    hipack_intern_t *pool = hipack_intern_new ();
+    for (unsigned i = 0; i < BENCH_MESSAGES; i++) {
+        hipack_reader_t reader = { .intern = pool };
+        hipack_dict_t *message = hipack_read_buffer (b->data, b->size, &reader);
+        if (!message) {
+            fprintf (stderr, "line %u, column %u: %s\n",
+                     reader.error_line, reader.error_column, reader.error);
+            abort ();
+        }
+        hipack_dict_free (message);
+    }
+    hipack_intern_free (pool);
+}
+
+
+/*
+ * Memory footprint of parsed messages. The allocator keeps the size of each
+ * chunk in front of it to track how much memory is in use, which is reported
+ * after the run along with the peak usage while parsing.
+ */
+struct footprint {
+    const char    *name;
+    struct buffer *input;
+    size_t         used;
+    size_t         peak;
+    size_t         result;
+    size_t         items;
+};
+
+
+static void*
+footprint_alloc (void *data, void *optr, size_t size)
+{
+    struct footprint *f = data;
+    size_t *chunk = optr ? (size_t*) optr - 1 : NULL;
+    if (chunk)
+        f->used -= *chunk;
+    chunk = hipack_alloc_stdlib (chunk, sizeof (size_t) + size);
+    *chunk = size;
+    f->used += size;
+    if (f->used > f->peak)
+        f->peak = f->used;
+    return chunk + 1;
+}
+
+
+static void
+footprint_free (void *data, void *optr)
+{
+    struct footprint *f = data;
+    size_t *chunk = (size_t*) optr - 1;
+    f->used -= *chunk;
+    hipack_alloc_stdlib (chunk, 0);
+}
+
+
+static void*
+setup_footprint_long_list (void)
+{
+    struct footprint *f = hipack_alloc_bzero (sizeof (struct footprint));
+    f->name = "footprint-long-list";
+    f->input = setup_long_list ();
+    f->items = 100000;
+    return f;
+}
+
+
+static void*
+setup_footprint_annotated_list (void)
+{
+    struct footprint *f = hipack_alloc_bzero (sizeof (struct footprint));
+    f->name = "footprint-annotated-list";
+    f->input = setup_annotated_list ();
+    f->items = 100000;
+    return f;
+}
+
+
+static void
+parse_footprint (void *data)
+{
+    struct footprint *f = data;
+    const hipack_allocator_t allocator = {
+        .alloc = footprint_alloc,
+        .free = footprint_free,
+        .user = f,
+    };
+    hipack_reader_t reader = { .allocator = &allocator };
+    f->used = f->peak = 0;
+    hipack_dict_t *message = hipack_read_buffer (f->input->data,
+                                                 f->input->size, &reader);
+    if (!message) {
+        fprintf (stderr, "line %u, column %u: %s\n",
+                 reader.error_line, reader.error_column, reader.error);
+        abort ();
+    }
+    f->result = f->used;
+    hipack_dict_free (message);
+}
+
+
+static void
+teardown_footprint (void *data)
+{
+    struct footprint *f = data;
+    printf ("%-28s %12zu bytes %9zu peak %8.1f bytes/item\n", f->name,
+            f->result, f->peak, (double) f->result / f->items);
+    buffer_free (f->input);
+    hipack_alloc_free (f);
+}
+
+
+/* Messages are written to /dev/null, to measure the cost of the writer. */
+struct write_bench {
+    hipack_dict_t *message;
+    FILE          *output;
+};
+
+
+static void*
+setup_write (void* (*setup) (void))
+{
+    struct buffer *b = setup ();
+    struct write_bench *w = hipack_alloc_stdlib (NULL, sizeof (struct write_bench));
+    hipack_reader_t reader = { 0 };
+    w->message = hipack_read_buffer (b->data, b->size, &reader);
+    w->output = fopen ("/dev/null", "wb");
+    if (!w->message || !w->output)
+        abort ();
+    buffer_free (b);
+    return w;
+}
+
+
+static void*
+setup_write_long_list (void)
+{
+    return setup_write (setup_long_list);
+}
+
+
+static void*
+setup_write_strings_dict (void)
+{
+    return setup_write (setup_strings_dict);
+}
+
+
+static void*
+setup_write_timestamps (void)
+{
+    return setup_write (setup_timestamps);
+}
+
+
+static void*
+setup_write_long_string (void)
+{
+    return setup_write (setup_long_string);
+}
+
+
+static void*
+setup_write_list_strings (void)
+{
+    return setup_write (setup_list_strings);
+}
+
+
+static void
+write_putchar (void *data)
+{
+    struct write_bench *w = data;
+    hipack_writer_t writer = {
+        .putchar = hipack_stdio_putchar,
+        .putchar_data = w->output,
+    };
+    if (hipack_write (&writer, w->message))
+        abort ();
+}
+
+
+static void
+write_blocks (void *data)
+{
+    struct write_bench *w = data;
+    hipack_writer_t writer = {
+        .write = hipack_stdio_write,
+        .write_data = w->output,
+    };
+    if (hipack_write (&writer, w->message))
+        abort ();
+}
+
+
+/* Appends output to a buffer one character at a time. */
+static int
+buffer_putchar (void *data, int ch)
+{
+    struct buffer *b = data;
+    if (b->size == b->alloc) {
+        b->alloc *= 2;
+        b->data = hipack_alloc_stdlib (b->data, b->alloc);
+    }
+    b->data[b->size++] = ch;
+    return ch;
+}
+
+
+static void
+write_buffer_putchar (void *data)
+{
+    struct write_bench *w = data;
+    struct buffer *b = buffer_new ();
+    hipack_writer_t writer = {
+        .putchar = buffer_putchar,
+        .putchar_data = b,
+    };
+    if (hipack_write (&writer, w->message))
+        abort ();
+    buffer_free (b);
+}
+
+
+static void
+write_buffer (void *data)
+{
+    struct write_bench *w = data;
+    size_t length;
+    hipack_alloc_free (hipack_write_to_buffer (w->message, HIPACK_WRITER_INDENTED,
+                                               false, &length));
+}
+
+
+static void
+write_buffer_exact (void *data)
+{
+    struct write_bench *w = data;
+    size_t length;
+    hipack_alloc_free (hipack_write_to_buffer (w->message, HIPACK_WRITER_INDENTED,
+                                               true, &length));
+}
+
+
+static void
+teardown_write (void *data)
+{
+    struct write_bench *w = data;
+    hipack_dict_free (w->message);
+    fclose (w->output);
+    hipack_alloc_stdlib (w, 0);
+}
+
+
+#ifndef BENCH_DICT_KEYS
+#define BENCH_DICT_KEYS 50000
+#endif /* !BENCH_DICT_KEYS */
+
+struct dict_bench {
+    hipack_string_t *keys[BENCH_DICT_KEYS];
+    hipack_string_t *missing[BENCH_DICT_KEYS];
+    hipack_dict_t   *dict;
+    double           probe_mean;
+    uint32_t         probe_max;
+};
+
+
+static void*
+setup_dict (void)
+{
+    struct dict_bench *d = hipack_alloc_stdlib (NULL, sizeof (struct dict_bench));
+    char buf[32];
+    d->dict = hipack_dict_new ();
+    for (unsigned i = 0; i < BENCH_DICT_KEYS; i++) {
+        d->keys[i] = hipack_string_new_from_lstring (buf,
+                snprintf (buf, sizeof (buf), "metric_%05u", i));
+        d->missing[i] = hipack_string_new_from_lstring (buf,
+                snprintf (buf, sizeof (buf), "missing_%05u", i));
+        hipack_value_t value = hipack_integer (i);
+        hipack_dict_set (d->dict, d->keys[i], &value);
+    }
+    return d;
+}
+
+
+static void*
+setup_dict_frozen (void)
+{
+    struct dict_bench *d = setup_dict ();
+    hipack_dict_freeze (d->dict);
+    return d;
+}
+
+
+static void
+teardown_dict (void *data)
+{
+    struct dict_bench *d = data;
+    for (unsigned i = 0; i < BENCH_DICT_KEYS; i++) {
+        hipack_string_free (d->keys[i]);
+        hipack_string_free (d->missing[i]);
+    }
+    hipack_dict_free (d->dict);
+    hipack_alloc_stdlib (d, 0);
+}
+
+
+static hipack_dict_t*
+dict_build (struct dict_bench *d)
+{
+    hipack_dict_t *dict = hipack_dict_new ();
+    for (unsigned i = 0; i < BENCH_DICT_KEYS; i++) {
+        hipack_value_t value = hipack_integer (i);
+        hipack_dict_set (dict, d->keys[i], &value);
+    }
+    return dict;
+}
+
+
+static void
+dict_set (void *data)
+{
+    hipack_dict_free (dict_build (data));
+}
+
+
+/* Same as dict_set(), freezing the dictionary after adding the keys. */
+static void
+dict_set_freeze (void *data)
+{
+    hipack_dict_t *dict = dict_build (data);
+    hipack_dict_freeze (dict);
+    hipack_dict_free (dict);
+}
+
+
+/* Same as dict_set(), reserving space for all the keys beforehand. */
+static void
+dict_set_reserve (void *data)
+{
+    struct dict_bench *d = data;
+    hipack_dict_t *dict = hipack_dict_new_with_capacity (BENCH_DICT_KEYS);
+    for (unsigned i = 0; i < BENCH_DICT_KEYS; i++) {
+        hipack_value_t value = hipack_integer (i);
+        hipack_dict_set (dict, d->keys[i], &value);
+    }
+    hipack_dict_free (dict);
+}
+
+
+/* Builds a dictionary and then deletes all the keys, in insertion order. */
+static void
+dict_set_del (void *data)
+{
+    struct dict_bench *d = data;
+    hipack_dict_t *dict = dict_build (d);
+    for (unsigned i = 0; i < BENCH_DICT_KEYS; i++)
+        hipack_dict_del (dict, d->keys[i]);
+    hipack_dict_free (dict);
+}
+
+
+static void
+dict_get (void *data)
+{
+    struct dict_bench *d = data;
+    for (unsigned i = 0; i < BENCH_DICT_KEYS; i++)
+        if (!hipack_dict_get (d->dict, d->keys[i]))
+            abort ();
+}
+
+
+/* Looks up keys which are not hipack_string_t, creating one for each. */
+static void
+dict_get_copy (void *data)
+{
+    struct dict_bench *d = data;
+    for (unsigned i = 0; i < BENCH_DICT_KEYS; i++) {
+        hipack_string_t *key =
+            hipack_string_new_from_lstring ((const char*) d->keys[i]->data,
+                                            d->keys[i]->size);
+        if (!hipack_dict_get (d->dict, key))
+            abort ();
+        hipack_string_free (key);
+    }
+}
+
+
+/* Same as dict_get_copy(), without creating strings. */
+static void
+dict_get_lstring (void *data)
+{
+    struct dict_bench *d = data;
+    for (unsigned i = 0; i < BENCH_DICT_KEYS; i++)
+        if (!hipack_dict_get_lstring (d->dict, (const char*) d->keys[i]->data,
+                                      d->keys[i]->size))
+            abort ();
+}
+
+
+static void*
+dict_get_thread (void *data)
+{
+    dict_get (data);
+    return NULL;
+}
+
+
+/* Same as dict_get(), with BENCH_THREADS threads sharing the dictionary. */
+static void
+dict_get_threads (void *data)
+{
+    pthread_t threads[BENCH_THREADS];
+    for (unsigned i = 0; i < BENCH_THREADS; i++)
+        if (pthread_create (&threads[i], NULL, dict_get_thread, data))
+            abort ();
+    for (unsigned i = 0; i < BENCH_THREADS; i++)
+        pthread_join (threads[i], NULL);
+}
+
+
+static void
+dict_get_missing (void *data)
+{
+    struct dict_bench *d = data;
+    for (unsigned i = 0; i < BENCH_DICT_KEYS; i++)
+        if (hipack_dict_get (d->dict, d->missing[i]))
+            abort ();
+}
+
+
+static void
+dict_iterate (void *data)
+{
+    struct dict_bench *d = data;
+    const hipack_string_t *key;
+    hipack_value_t *value;
+    int32_t sum = 0;
+    HIPACK_DICT_FOREACH (d->dict, key, value)
+        sum += hipack_value_get_integer (value);
+    if (sum != (int32_t) ((BENCH_DICT_KEYS - 1) * (BENCH_DICT_KEYS / 2)))
+        abort ();
+}
+
+
+static void
+string_hash (void *data)
+{
+    struct dict_bench *d = data;
+    uint32_t hash = 0;
+    for (unsigned i = 0; i < BENCH_DICT_KEYS; i++)
+        hash ^= hipack_string_hash (d->keys[i]);
+    /* Prevent the compiler from optimizing out the loop. */
+    if (hash == 0xDEADBEEF)
+        fputc ('\0', stderr);
+}
+
+
+/*
+ * Measures the number of slots of the index which are probed when looking
+ * up each key, which depends on how well hash values are distributed.
+ */
+static void
+dict_probes (void *data)
+{
+    struct dict_bench *d = data;
+    const hipack_dict_t *dict = d->dict;
+    const uint32_t mask = dict->size - 1;
+    uint64_t total = 0;
+
+    d->probe_max = 0;
+    for (uint32_t slot = 0; slot < dict->size; slot++) {
+        uint32_t entry = dict->index[slot];
+        if (!entry)
+            continue;
+        /* No elements were removed: entries are in the order of the keys. */
+        uint32_t hash = hipack_string_hash (d->keys[entry - 1]);
+        uint32_t home = (hash * UINT32_C (2654435769)) >> dict->shift;
+        uint32_t probes = ((slot - home) & mask) + 1;
+        if (probes > d->probe_max)
+            d->probe_max = probes;
+        total += probes;
+    }
+    d->probe_mean = (double) total / hipack_dict_size (dict);
+}
+
+
+static void
+teardown_dict_probes (void *data)
+{
+    struct dict_bench *d = data;
+    printf ("%-28s %12.3f mean probes %8u longest\n", "dict-probes",
+            d->probe_mean, d->probe_max);
+    teardown_dict (data);
+}
+
+
+static const struct {
+    const char *name;
+    void*     (*setup) (void);
+    void      (*run) (void*);
+    void      (*teardown) (void*);
+} benchmarks[] = {
+    { "parse-long-string",        setup_long_string,  parse_buffer, buffer_free },
+    { "parse-long-string-blocks", setup_long_string,  parse_blocks, buffer_free },
+    { "parse-long-list",          setup_long_list,    parse_buffer, buffer_free },
+    { "parse-annotated-list",     setup_annotated_list, parse_buffer, buffer_free },
+    { "parse-float-list",         setup_float_list,   parse_buffer, buffer_free },
+    { "parse-list-strings",       setup_list_strings, parse_buffer, buffer_free },
+    { "parse-list-strings-arena", setup_list_strings, parse_buffer_arena, buffer_free },
+    { "parse-strings-dict",       setup_strings_dict, parse_buffer, buffer_free },
+    { "parse-strings-dict-arena", setup_strings_dict, parse_buffer_arena, buffer_free },
+    { "parse-messages",           setup_small_message, parse_messages, buffer_free },
+    { "parse-messages-intern",    setup_small_message, parse_messages_intern, buffer_free },
+    { "footprint-long-list",      setup_footprint_long_list, parse_footprint, teardown_footprint },
+    { "footprint-annotated-list", setup_footprint_annotated_list, parse_footprint, teardown_footprint },
+    { "write-long-list-putchar",  setup_write_long_list, write_putchar, teardown_write },
+    { "write-long-list",          setup_write_long_list, write_blocks, teardown_write },
+    { "write-strings-dict-putchar", setup_write_strings_dict, write_putchar, teardown_write },
+    { "write-strings-dict",       setup_write_strings_dict, write_blocks, teardown_write },
+    { "write-timestamps",         setup_write_timestamps, write_blocks, teardown_write },
+    { "write-long-string",        setup_write_long_string, write_blocks, teardown_write },
+    { "write-list-strings",       setup_write_list_strings, write_blocks, teardown_write },
+    { "write-buffer-putchar",     setup_write_strings_dict, write_buffer_putchar, teardown_write },
+    { "write-buffer",             setup_write_strings_dict, write_buffer, teardown_write },
+    { "write-buffer-exact",       setup_write_strings_dict, write_buffer_exact, teardown_write },
+    { "floats-parse",             setup_floats,       floats_parse, buffer_free },
+    { "floats-strtod",            setup_floats,       floats_strtod, buffer_free },
+    { "dict-set",                 setup_dict,         dict_set,     teardown_dict },
+    { "dict-set-reserve",         setup_dict,         dict_set_reserve, teardown_dict },
+    { "dict-set-freeze",          setup_dict,         dict_set_freeze, teardown_dict },
+    { "dict-set-del",             setup_dict,         dict_set_del, teardown_dict },
+    { "dict-get",                 setup_dict,         dict_get,     teardown_dict },
+    { "dict-get-copy",            setup_dict,         dict_get_copy, teardown_dict },
+    { "dict-get-lstring",         setup_dict,         dict_get_lstring, teardown_dict },
+    { "dict-get-threads",         setup_dict,         dict_get_threads, teardown_dict },
+    { "dict-get-missing",         setup_dict,         dict_get_missing, teardown_dict },
+    { "dict-get-frozen",          setup_dict_frozen,  dict_get,     teardown_dict },
+    { "dict-get-missing-frozen",  setup_dict_frozen,  dict_get_missing, teardown_dict },
+    { "dict-iterate",             setup_dict,         dict_iterate, teardown_dict },
+    { "dict-probes",              setup_dict,         dict_probes,  teardown_dict_probes },
+    { "string-hash",              setup_dict,         string_hash,  teardown_dict },
+};
+
+
+static inline double
+now (void)
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static void
+run_benchmark (size_t i)
+{
+    void *data = benchmarks[i].setup ? benchmarks[i].setup () : NULL;
+
+    /*
+     * Repeat until the elapsed time is long enough to be meaningful. Both
+     * the mean and the fastest iteration are reported: the latter is less
+     * sensitive to noise caused by other processes.
+     */
+    unsigned long iterations = 0;
+    double elapsed = 0.0, fastest = 0.0;
+    do {
+        double start = now ();
+        benchmarks[i].run (data);
+        double t = now () - start;
+        if (!iterations || t < fastest)
+            fastest = t;
+        elapsed += t;
+        iterations++;
+    } while (elapsed < BENCH_MIN_SECONDS);
+
+    if (benchmarks[i].teardown)
+        benchmarks[i].teardown (data);
+
+    printf ("%-28s %12.3f us/iter %12.3f us/best (%lu iterations)\n",
+            benchmarks[i].name, elapsed * 1e6 / iterations, fastest * 1e6,
+            iterations);
+    fflush (stdout);
+}
+
+
+int
+main (int argc, const char *argv[])
+{
+    const size_t n_benchmarks = sizeof (benchmarks) / sizeof (benchmarks[0]);
+
+    if (argc < 2) {
+        for (size_t i = 0; i < n_benchmarks; i++)
+            run_benchmark (i);
+        return EXIT_SUCCESS;
+    }
+
+    int retcode = EXIT_SUCCESS;
+    for (int j = 1; j < argc; j++) {
+        size_t i = 0;
+        for (; i < n_benchmarks; i++) {
+            if (!strcmp (argv[j], benchmarks[i].name)) {
+                run_benchmark (i);
+                break;
+            }
+        }
+        if (i == n_benchmarks) {
+            fprintf (stderr, "%s: unknown benchmark '%s'\n", argv[0], argv[j]);
+            retcode = EXIT_FAILURE;
+        }
+    }
+    return retcode;
+}
@@ -44,38 +44,30 @@ main (int argc, char *argv[])
         usage (argv[0], EXIT_FAILURE);
     }
 
-    FILE *fp = fopen (argv[optind], "rb");
-    if (!fp) {
-        fprintf (stderr, "%s: Cannot open '%s' (%s)\n",
-                 argv[0], argv[optind], strerror (errno));
-        return EXIT_FAILURE;
-    }
-
     int retcode = EXIT_SUCCESS;
-    hipack_reader_t reader = {
-        .getchar = hipack_stdio_getchar,
-        .getchar_data = fp,
-    };
-    hipack_dict_t *message = hipack_read (&reader);
+    hipack_reader_t reader = { 0 };
+    hipack_dict_t *message = hipack_read_file (argv[optind], &reader);
     if (!message) {
         assert (reader.error);
-        fprintf (stderr, "line %u, column %u: %s\n",
-                 reader.error_line, reader.error_column,
-                 (reader.error == HIPACK_READ_ERROR)
-                    ? strerror (errno) : reader.error);
+        if (reader.error == HIPACK_READ_ERROR) {
+            fprintf (stderr, "%s: Cannot read '%s' (%s)\n",
+                     argv[0], argv[optind], strerror (errno));
+        } else {
+            fprintf (stderr, "line %u, column %u: %s\n",
+                     reader.error_line, reader.error_column, reader.error);
+        }
         retcode = EXIT_FAILURE;
         goto cleanup;
     }
 
     hipack_writer_t writer = {
-        .putchar = hipack_stdio_putchar,
-        .putchar_data = stdout,
+        .write = hipack_stdio_write,
+        .write_data = stdout,
         .indent = compact ? HIPACK_WRITER_COMPACT : HIPACK_WRITER_INDENTED,
     };
     hipack_write (&writer, message);
 
 cleanup:
-    fclose (fp);
     hipack_dict_free (message);
     return retcode;
 }
@@ -27,46 +27,44 @@ main (int argc, const char *argv[])
     }
 
     bool use_stdin = argv[1][0] == '-' && argv[1][1] == '\0';
-    FILE *fp = use_stdin ? stdin : fopen (argv[1], "rb");
-    if (!fp) {
-        fprintf (stderr, "%s: Cannot open '%s' (%s)\n",
-                 argv[0], argv[1], strerror (errno));
-        return EXIT_FAILURE;
+    hipack_dict_t *message;
+    hipack_reader_t reader = { 0 };
+
+    if (use_stdin) {
+        reader = (hipack_reader_t) {
+            .read = hipack_stdio_read,
+            .read_data = stdin,
+        };
+        message = hipack_read (&reader);
+    } else {
+        message = hipack_read_file (argv[1], &reader);
     }
 
-    int retcode = EXIT_SUCCESS;
-    hipack_reader_t reader = {
-        .getchar = hipack_stdio_getchar,
-        .getchar_data = fp,
-    };
-    hipack_dict_t *message = hipack_read (&reader);
     if (!message) {
         assert (reader.error);
-        fprintf (stderr, "line %u, column %u: %s\n",
-                 reader.error_line, reader.error_column,
-                 (reader.error == HIPACK_READ_ERROR)
-                    ? strerror (errno) : reader.error);
-        retcode = EXIT_FAILURE;
+        if (reader.error == HIPACK_READ_ERROR) {
+            fprintf (stderr, "%s: Cannot read '%s' (%s)\n",
+                     argv[0], argv[1], strerror (errno));
+        } else {
+            fprintf (stderr, "line %u, column %u: %s\n",
+                     reader.error_line, reader.error_column, reader.error);
+        }
+        return EXIT_FAILURE;
     }
-    fclose (fp);
 
-    if (retcode != EXIT_SUCCESS)
-        return retcode;
+    int retcode = EXIT_SUCCESS;
 
     hipack_value_t *value = &((hipack_value_t) {
-        .type   = HIPACK_DICT,
-        .v_dict = message
+        .v_dict = message,
+        .tag    = HIPACK_DICT,
     });
 
     for (unsigned i = 2; i < argc && value; i++) {
         switch (hipack_value_type (value)) {
-            case HIPACK_DICT: {
+            case HIPACK_DICT:
                 /* Use argv[i] as dictionary key. */
-                hipack_string_t *key = hipack_string_new_from_string (argv[i]);
-                value = hipack_dict_get (value->v_dict, key);
-                hipack_string_free (key);
+                value = hipack_dict_get_string (value->v_dict, argv[i]);
                 break;
-            }
             case HIPACK_LIST: {
                 /* Use argv[i] as a list index. */
                 const char *error = NULL;
@@ -93,8 +91,8 @@ main (int argc, const char *argv[])
 
     if (value) {
         hipack_writer_t writer = {
-            .putchar = hipack_stdio_putchar,
-            .putchar_data = stdout,
+            .write = hipack_stdio_write,
+            .write_data = stdout,
         };
         if (hipack_write_value (&writer, value)) {
             fprintf (stderr, "%s: write error (%s)\n",
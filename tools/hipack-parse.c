@@ -28,8 +28,8 @@ main (int argc, const char *argv[])
 
     int retcode = EXIT_SUCCESS;
     hipack_reader_t reader = {
-        .getchar = hipack_stdio_getchar,
-        .getchar_data = fp,
+        .read = hipack_stdio_read,
+        .read_data = fp,
     };
     hipack_dict_t *message = hipack_read (&reader);
     if (!message) {
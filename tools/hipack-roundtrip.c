@@ -44,37 +44,29 @@ main (int argc, char *argv[])
         usage (argv[0], EXIT_FAILURE);
     }
 
-    FILE *fp = fopen (argv[optind], "rb");
-    if (!fp) {
-        fprintf (stderr, "%s: Cannot open '%s' (%s)\n",
-                 argv[0], argv[optind], strerror (errno));
-        return EXIT_FAILURE;
-    }
-
     int retcode = EXIT_SUCCESS;
-    hipack_reader_t reader = {
-        .getchar = hipack_stdio_getchar,
-        .getchar_data = fp,
-    };
-    hipack_dict_t *message1 = hipack_read (&reader);
+    hipack_reader_t reader = { 0 };
+    hipack_dict_t *message1 = hipack_read_file (argv[optind], &reader);
     hipack_dict_t *message2 = NULL;
+    FILE *fp = NULL;
     if (!message1) {
         assert (reader.error);
-        fprintf (stderr, "[pass 1] line %u, column %u: %s\n",
-                 reader.error_line, reader.error_column,
-                 (reader.error == HIPACK_READ_ERROR)
-                    ? strerror (errno) : reader.error);
+        if (reader.error == HIPACK_READ_ERROR) {
+            fprintf (stderr, "[pass 1] %s: Cannot read '%s' (%s)\n",
+                     argv[0], argv[optind], strerror (errno));
+        } else {
+            fprintf (stderr, "[pass 1] line %u, column %u: %s\n",
+                     reader.error_line, reader.error_column, reader.error);
+        }
         retcode = EXIT_FAILURE;
         goto cleanup;
     }
 
-    fclose (fp);
-
     /* Create a temporary file and write the message to it. */
     fp = tmpfile ();
     hipack_writer_t writer = {
-        .putchar = hipack_stdio_putchar,
-        .putchar_data = fp,
+        .write = hipack_stdio_write,
+        .write_data = fp,
         .indent = compact ? HIPACK_WRITER_COMPACT : HIPACK_WRITER_INDENTED,
     };
 
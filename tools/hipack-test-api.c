@@ -2,8 +2,14 @@
  * SPDX-License-Identifier: MIT
  */
 
+#define _POSIX_C_SOURCE 200809L
 #include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
 #include "../hipack.h"
+#include "../hipack-scan.h"
+#include "../hipack-float.h"
 
 enum test_result {
 	TEST_PASS,
@@ -36,6 +42,48 @@ cleanup_value(hipack_value_t *valp)
 		hipack_value_free(valp);
 }
 
+static inline void
+cleanup_dict(hipack_dict_t **dictp)
+{
+	if (dictp)
+		hipack_dict_free(*dictp);
+}
+
+struct chunked_input {
+	const char *data;
+	size_t size;
+	size_t chunk;
+};
+
+static int
+chunked_getchar(void *data)
+{
+	struct chunked_input *in = data;
+	if (!in->size)
+		return HIPACK_IO_EOF;
+	in->size--;
+	return (uint8_t) *in->data++;
+}
+
+static int
+chunked_read(void *data, uint8_t *buffer, size_t size)
+{
+	struct chunked_input *in = data;
+	size_t n = (in->chunk < size) ? in->chunk : size;
+	if (n > in->size)
+		n = in->size;
+	memcpy(buffer, in->data, n);
+	in->data += n;
+	in->size -= n;
+	return (int) n;
+}
+
+static const char test_message[] =
+	"# Comment\n"
+	"title: \"Quick \\\"brown\\\" fox\"\n"
+	"numbers [1, 2.5, -0x10, 0755] # Another comment\n"
+	"nested {flag: True, empty: [], list: [\"a\" \"b\"]}\n";
+
 TEST(value_equal)
 {
 	hipack_value_t a cleanup(value) = hipack_integer(42);
@@ -45,6 +93,7 @@ TEST(value_equal)
 	hipack_value_t e cleanup(value) = hipack_dict(hipack_dict_new());
 	hipack_value_t f cleanup(value) = hipack_list(hipack_list_new(0));
 	hipack_value_t g cleanup(value) = hipack_list(hipack_list_new(0));
+	hipack_value_t h cleanup(value) = hipack_integer(INT64_C(42) + (INT64_C(1) << 32));
 
 	check(hipack_value_equal(&a, &a));
 	check(hipack_value_equal(&b, &b));
@@ -58,6 +107,7 @@ TEST(value_equal)
 	check(!hipack_value_equal(&a, &c));
 	check(!hipack_value_equal(&a, &d));
 	check(!hipack_value_equal(&a, &e));
+	check(!hipack_value_equal(&a, &h));
 
 	return TEST_PASS;
 }
@@ -79,7 +129,7 @@ TEST(list_equal)
 
 	*HIPACK_LIST_AT(l3, 0) = hipack_bool(true);
 	*HIPACK_LIST_AT(l3, 2) = hipack_bool(true);
-	*HIPACK_LIST_AT(l3, 2) = hipack_bool(false);
+	*HIPACK_LIST_AT(l3, 1) = hipack_bool(false);
 
 	check(hipack_list_equal(l0, l0));
 	check(hipack_list_equal(l3, l3));
@@ -95,6 +145,998 @@ TEST(list_equal)
 	return TEST_PASS;
 }
 
+TEST(string_hash)
+{
+	/* Similar keys of all sizes up to 64 characters should not collide. */
+	static const char text[] =
+		"0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ__";
+	uint32_t hashes[2 * 64];
+	for (uint32_t len = 1; len <= 64; len++) {
+		hipack_string_t *a = hipack_string_new_from_lstring(text, len);
+		hipack_string_t *b = hipack_string_new_from_lstring(text, len);
+		b->data[len - 1] ^= 1;
+		hashes[2 * (len - 1)] = hipack_string_hash(a);
+		hashes[2 * (len - 1) + 1] = hipack_string_hash(b);
+		hipack_string_free(a);
+		hipack_string_free(b);
+	}
+	for (size_t i = 0; i < 2 * 64; i++)
+		for (size_t j = i + 1; j < 2 * 64; j++)
+			check(hashes[i] != hashes[j]);
+
+	/* The seed changes hash values. */
+	hipack_string_t *key = hipack_string_new_from_string("metric_00042");
+	uint32_t hash = hipack_string_hash(key);
+	hipack_string_hash_set_seed(0x1234);
+	uint32_t seeded_hash = hipack_string_hash(key);
+	hipack_string_hash_set_seed(0);
+	check(hipack_string_hash(key) == hash);
+	hipack_string_free(key);
+	check(seeded_hash != hash);
+
+	return TEST_PASS;
+}
+
+TEST(dict_set_del)
+{
+	hipack_dict_t *dict cleanup(dict) = hipack_dict_new();
+	hipack_string_t *keys[1000];
+	char buf[32];
+
+	/* Mix keys stored in the entries with longer ones. */
+	for (unsigned i = 0; i < 1000; i++) {
+		keys[i] = hipack_string_new_from_lstring(buf,
+				snprintf(buf, sizeof(buf), (i % 3) ? "key%u" : "longer-key-name-%u", i));
+		hipack_value_t value = hipack_integer(i);
+		hipack_dict_set(dict, keys[i], &value);
+	}
+	check(hipack_dict_size(dict) == 1000);
+
+	/* Remove every other key, then check that the rest can be found. */
+	for (unsigned i = 0; i < 1000; i += 2)
+		hipack_dict_del(dict, keys[i]);
+	check(hipack_dict_size(dict) == 500);
+	for (unsigned i = 0; i < 1000; i++) {
+		hipack_value_t *value = hipack_dict_get(dict, keys[i]);
+		check((i % 2) ? (value && hipack_value_get_integer(value) == i) : !value);
+	}
+
+	/* Elements are iterated in insertion order, skipping removed ones. */
+	const hipack_string_t *key;
+	hipack_value_t *value;
+	unsigned expected = 1;
+	HIPACK_DICT_FOREACH(dict, key, value) {
+		check(hipack_string_equal(key, keys[expected]));
+		check(hipack_value_get_integer(value) == expected);
+		expected += 2;
+	}
+	check(expected == 1001);
+
+	/* Reinserting removed keys reuses the space of removed entries. */
+	for (unsigned i = 0; i < 1000; i += 2) {
+		hipack_value_t value = hipack_integer(-(int32_t) i);
+		hipack_dict_set(dict, keys[i], &value);
+	}
+	check(hipack_dict_size(dict) == 1000);
+	for (unsigned i = 0; i < 1000; i++) {
+		hipack_value_t *value = hipack_dict_get(dict, keys[i]);
+		check(value && hipack_value_get_integer(value) == ((i % 2) ? (int32_t) i : -(int32_t) i));
+	}
+
+	for (unsigned i = 0; i < 1000; i++) {
+		hipack_dict_del(dict, keys[i]);
+		hipack_string_free(keys[i]);
+	}
+	check(hipack_dict_size(dict) == 0);
+	check(!hipack_dict_first(dict, &key));
+
+	return TEST_PASS;
+}
+
+TEST(dict_reserve)
+{
+	hipack_dict_t *dict cleanup(dict) = hipack_dict_new_with_capacity(100);
+	hipack_value_t value = hipack_integer(0);
+	char buf[16];
+
+	hipack_string_t *key = hipack_string_new_from_string("key0");
+	hipack_dict_set_adopt_key(dict, &key, &value);
+
+	/* Values do not move while adding up to the reserved capacity. */
+	const hipack_string_t *first_key;
+	hipack_value_t *first = hipack_dict_first(dict, &first_key);
+	for (unsigned i = 1; i < 100; i++) {
+		key = hipack_string_new_from_lstring(buf, snprintf(buf, sizeof(buf), "key%u", i));
+		value = hipack_integer(i);
+		hipack_dict_set_adopt_key(dict, &key, &value);
+	}
+	check(hipack_dict_size(dict) == 100);
+	check(hipack_dict_first(dict, &first_key) == first);
+
+	/* Reserving less than the current size is a no-op. */
+	hipack_dict_reserve(dict, 10);
+	check(hipack_dict_first(dict, &first_key) == first);
+
+	hipack_dict_reserve(dict, 1000);
+	for (unsigned i = 0; i < 100; i++) {
+		key = hipack_string_new_from_lstring(buf, snprintf(buf, sizeof(buf), "key%u", i));
+		hipack_value_t *v = hipack_dict_get(dict, key);
+		hipack_string_free(key);
+		check(v && hipack_value_get_integer(v) == i);
+	}
+
+	return TEST_PASS;
+}
+
+#define CONCURRENT_THREADS 8
+#define CONCURRENT_KEYS    1000
+
+struct concurrent_lookups {
+	const hipack_dict_t *dict;
+	hipack_string_t *keys[CONCURRENT_KEYS];
+	hipack_string_t *missing;
+};
+
+static void*
+concurrent_lookups_run(void *data)
+{
+	const struct concurrent_lookups *c = data;
+	for (unsigned round = 0; round < 20; round++) {
+		for (unsigned i = 0; i < CONCURRENT_KEYS; i++) {
+			const hipack_value_t *value = hipack_dict_get(c->dict, c->keys[i]);
+			if (!value || hipack_value_get_integer(value) != i)
+				return (void*) c;
+		}
+		if (hipack_dict_get(c->dict, c->missing))
+			return (void*) c;
+
+		const hipack_string_t *key;
+		hipack_value_t *value;
+		unsigned count = 0;
+		HIPACK_DICT_FOREACH(c->dict, key, value)
+			count++;
+		if (count != CONCURRENT_KEYS)
+			return (void*) c;
+	}
+	return NULL;
+}
+
+TEST(dict_concurrent_get)
+{
+	hipack_dict_t *dict cleanup(dict) = hipack_dict_new();
+	struct concurrent_lookups c = { .dict = dict };
+	char buf[16];
+
+	for (unsigned i = 0; i < CONCURRENT_KEYS; i++) {
+		c.keys[i] = hipack_string_new_from_lstring(buf,
+				snprintf(buf, sizeof(buf), "key%u", i));
+		hipack_value_t value = hipack_integer(i);
+		hipack_dict_set(dict, c.keys[i], &value);
+	}
+	c.missing = hipack_string_new_from_string("missing");
+
+	/* Lookups and iteration do not modify the dictionary. */
+	pthread_t threads[CONCURRENT_THREADS];
+	for (unsigned i = 0; i < CONCURRENT_THREADS; i++)
+		check(pthread_create(&threads[i], NULL, concurrent_lookups_run, &c) == 0);
+
+	bool ok = true;
+	for (unsigned i = 0; i < CONCURRENT_THREADS; i++) {
+		void *result;
+		pthread_join(threads[i], &result);
+		ok = ok && !result;
+	}
+
+	for (unsigned i = 0; i < CONCURRENT_KEYS; i++)
+		hipack_string_free(c.keys[i]);
+	hipack_string_free(c.missing);
+
+	check(ok);
+	return TEST_PASS;
+}
+
+static bool
+check_frozen_lookups(const hipack_dict_t *dict, hipack_string_t **keys, unsigned n)
+{
+	for (unsigned i = 0; i < n; i++) {
+		const hipack_value_t *value = hipack_dict_get(dict, keys[i]);
+		if (!value || hipack_value_get_integer(value) != i)
+			return false;
+	}
+
+	/* Iteration order is kept, the keys are the first elements. */
+	const hipack_string_t *key;
+	hipack_value_t *value;
+	unsigned i = 0;
+	HIPACK_DICT_FOREACH(dict, key, value) {
+		if (i < n && !hipack_string_equal(key, keys[i]))
+			return false;
+		i++;
+	}
+	return i >= n;
+}
+
+struct hash_key {
+	uint32_t hash;
+	uint32_t n;
+};
+
+static int
+hash_key_compare(const void *a, const void *b)
+{
+	uint32_t ha = ((const struct hash_key*) a)->hash;
+	uint32_t hb = ((const struct hash_key*) b)->hash;
+	return (ha > hb) - (ha < hb);
+}
+
+TEST(dict_freeze)
+{
+	hipack_dict_t *dict cleanup(dict) = hipack_dict_new();
+	hipack_string_t *keys[1000];
+	char buf[32];
+
+	/* Mix keys stored in the entries with longer ones. */
+	for (unsigned i = 0; i < 1000; i++) {
+		keys[i] = hipack_string_new_from_lstring(buf,
+				snprintf(buf, sizeof(buf), (i % 3) ? "key%u" : "longer-key-name-%u", i));
+		hipack_value_t value = hipack_integer(i);
+		hipack_dict_set(dict, keys[i], &value);
+	}
+	/* Removed elements must not appear in the frozen dictionary. */
+	hipack_value_t value = hipack_bool(true);
+	hipack_string_t *removed = hipack_string_new_from_string("removed");
+	hipack_dict_set(dict, removed, &value);
+	hipack_dict_del(dict, removed);
+
+	/* Nested dictionaries, also inside lists, are frozen as well. */
+	hipack_list_t *list = hipack_list_new(1);
+	list->data[0] = hipack_dict(hipack_dict_new());
+	hipack_value_t nested = hipack_list(list);
+	hipack_string_t *nested_key = hipack_string_new_from_string("nested");
+	hipack_dict_set_adopt_key(list->data[0].v_dict, &nested_key, &value);
+	hipack_string_t *list_key = hipack_string_new_from_string("list");
+	hipack_dict_set_adopt_key(dict, &list_key, &nested);
+
+	hipack_dict_freeze(dict);
+	check(hipack_dict_is_frozen(dict));
+	check(dict->buckets > 0);
+	check(hipack_dict_size(dict) == 1001);
+	check(check_frozen_lookups(dict, keys, 1000));
+	check(!hipack_dict_get(dict, removed));
+	hipack_string_free(removed);
+
+	list_key = hipack_string_new_from_string("list");
+	const hipack_value_t *v = hipack_dict_get(dict, list_key);
+	hipack_string_free(list_key);
+	check(v && hipack_value_is_list(v));
+	check(hipack_dict_is_frozen(v->v_list->data[0].v_dict));
+
+	/* Keys with the same hash value need the fallback index. */
+	struct hash_key *hashes = malloc(sizeof(struct hash_key) * 300000);
+	for (uint32_t i = 0; i < 300000; i++) {
+		hipack_string_t *key = hipack_string_new_from_lstring(buf,
+				snprintf(buf, sizeof(buf), "collide%u", i));
+		hashes[i] = (struct hash_key) { hipack_string_hash(key), i };
+		hipack_string_free(key);
+	}
+	qsort(hashes, 300000, sizeof(struct hash_key), hash_key_compare);
+	uint32_t i = 1;
+	while (i < 300000 && hashes[i].hash != hashes[i - 1].hash)
+		i++;
+	check(i < 300000);
+
+	hipack_dict_t *colliding cleanup(dict) = hipack_dict_new();
+	hipack_string_t *colliding_keys[2];
+	for (unsigned j = 0; j < 2; j++) {
+		colliding_keys[j] = hipack_string_new_from_lstring(buf,
+				snprintf(buf, sizeof(buf), "collide%u", hashes[i - j].n));
+		value = hipack_integer(j);
+		hipack_dict_set(colliding, colliding_keys[j], &value);
+	}
+	free(hashes);
+	hipack_dict_freeze(colliding);
+	bool colliding_ok = !colliding->buckets &&
+		check_frozen_lookups(colliding, colliding_keys, 2);
+
+	for (unsigned j = 0; j < 2; j++)
+		hipack_string_free(colliding_keys[j]);
+	for (unsigned j = 0; j < 1000; j++)
+		hipack_string_free(keys[j]);
+
+	check(colliding_ok);
+	return TEST_PASS;
+}
+
+TEST(dict_get_lstring)
+{
+	hipack_dict_t *dict cleanup(dict) = hipack_dict_new();
+	hipack_value_t value = hipack_integer(42);
+	hipack_string_t *key = hipack_string_new_from_string("answer");
+	hipack_dict_set_adopt_key(dict, &key, &value);
+
+	/* The string is not zero-terminated after the key length. */
+	hipack_value_t *v = hipack_dict_get_lstring(dict, "answers", 6);
+	check(v && hipack_value_get_integer(v) == 42);
+	check(hipack_dict_get_string(dict, "answer") == v);
+	check(!hipack_dict_get_string(dict, "answers"));
+	check(!hipack_dict_get_lstring(dict, "answer", 5));
+	check(!hipack_dict_get_lstring(dict, "", 0));
+
+	hipack_dict_del_lstring(dict, "answer", 5);
+	check(hipack_dict_size(dict) == 1);
+	hipack_dict_del_string(dict, "answer");
+	check(hipack_dict_size(dict) == 0);
+
+	hipack_value_t annotated cleanup(value) = hipack_integer(0);
+	hipack_value_add_annot(&annotated, "units");
+	check(hipack_value_has_annot(&annotated, "units"));
+	check(!hipack_value_has_annot(&annotated, "unit"));
+	hipack_value_del_annot(&annotated, "units");
+	check(!hipack_value_has_annot(&annotated, "units"));
+
+	return TEST_PASS;
+}
+
+TEST(read_chunked)
+{
+	struct chunked_input in = { test_message, sizeof(test_message) - 1, 0 };
+	hipack_reader_t reader = {
+		.getchar = chunked_getchar,
+		.getchar_data = &in,
+	};
+	hipack_dict_t *expected cleanup(dict) = hipack_read(&reader);
+	check(expected);
+	check(hipack_dict_size(expected) == 3);
+
+	for (size_t chunk = 1; chunk < sizeof(test_message); chunk++) {
+		in = (struct chunked_input) { test_message, sizeof(test_message) - 1, chunk };
+		reader = (hipack_reader_t) {
+			.read = chunked_read,
+			.read_data = &in,
+		};
+		hipack_dict_t *message cleanup(dict) = hipack_read(&reader);
+		check(message);
+		check(hipack_dict_equal(expected, message));
+	}
+
+	static const char bad_message[] = "a: 1\nbad: 1..1\n";
+	in = (struct chunked_input) { bad_message, sizeof(bad_message) - 1, 3 };
+	reader = (hipack_reader_t) {
+		.read = chunked_read,
+		.read_data = &in,
+	};
+	check(!hipack_read(&reader));
+	check(reader.error_line == 2);
+	check(reader.error_column == 9);
+
+	return TEST_PASS;
+}
+
+TEST(read_buffer)
+{
+	struct chunked_input in = { test_message, sizeof(test_message) - 1, 0 };
+	hipack_reader_t reader = {
+		.getchar = chunked_getchar,
+		.getchar_data = &in,
+	};
+	hipack_dict_t *expected cleanup(dict) = hipack_read(&reader);
+	check(expected);
+
+	hipack_dict_t *message cleanup(dict) =
+		hipack_read_buffer((const uint8_t*) test_message,
+		                   sizeof(test_message) - 1, &reader);
+	check(message);
+	check(hipack_dict_equal(expected, message));
+
+	hipack_string_t *key = hipack_string_new_from_string("title");
+	const hipack_value_t *title = hipack_dict_get(message, key);
+	hipack_string_free(key);
+	check(title);
+	check(hipack_value_is_string(title));
+	const hipack_string_t *str = hipack_value_get_string(title);
+	check(str->size == 17);
+	check(!memcmp(str->data, "Quick \"brown\" fox", 17));
+
+	static const char bad_message[] = "a: \"multi\nline\"\nbad: 1..1\n";
+	check(!hipack_read_buffer((const uint8_t*) bad_message,
+	                          sizeof(bad_message) - 1, &reader));
+	check(reader.error_line == 3);
+	check(reader.error_column == 9);
+
+	hipack_dict_t *empty cleanup(dict) = hipack_read_buffer((const uint8_t*) "", 0, &reader);
+	check(empty);
+	check(hipack_dict_size(empty) == 0);
+
+	return TEST_PASS;
+}
+
+TEST(read_file)
+{
+	hipack_reader_t reader = { 0 };
+	hipack_dict_t *expected cleanup(dict) =
+		hipack_read_buffer((const uint8_t*) test_message,
+		                   sizeof(test_message) - 1, &reader);
+	check(expected);
+
+	char path[] = "/tmp/hipack-test-api-XXXXXX";
+	int fd = mkstemp(path);
+	check(fd != -1);
+	ssize_t written = write(fd, test_message, sizeof(test_message) - 1);
+	close(fd);
+	check(written == sizeof(test_message) - 1);
+
+	hipack_dict_t *message cleanup(dict) = hipack_read_file(path, &reader);
+	unlink(path);
+	check(message);
+	check(hipack_dict_equal(expected, message));
+
+	check(!hipack_read_file(path, &reader));
+	check(reader.error == HIPACK_READ_ERROR);
+	check(errno == ENOENT);
+
+	return TEST_PASS;
+}
+
+static size_t alloc_count = 0;
+
+static void*
+counting_alloc(void *optr, size_t size)
+{
+	if (size)
+		alloc_count++;
+	return hipack_alloc_stdlib(optr, size);
+}
+
+TEST(read_arena)
+{
+	hipack_reader_t reader = { 0 };
+	hipack_dict_t *expected cleanup(dict) =
+		hipack_read_buffer((const uint8_t*) test_message,
+		                   sizeof(test_message) - 1, &reader);
+	check(expected);
+
+	hipack_alloc = counting_alloc;
+	hipack_arena_t *arena = hipack_arena_new(0);
+	reader = (hipack_reader_t) { .allocator = hipack_arena_allocator(arena) };
+	hipack_dict_t *message =
+		hipack_read_buffer((const uint8_t*) test_message,
+		                   sizeof(test_message) - 1, &reader);
+	size_t count = alloc_count;
+	hipack_alloc = hipack_alloc_stdlib;
+
+	check(message);
+	check(hipack_dict_equal(expected, message));
+	/* Only the arena and its first block are allocated with malloc(). */
+	check(count == 2);
+
+	/* Growing chunks, both small and big, must keep their contents. */
+	char *small = hipack_arena_alloc(arena, NULL, 3);
+	memcpy(small, "abc", 3);
+	char *other = hipack_arena_alloc(arena, NULL, 16);
+	small = hipack_arena_alloc(arena, small, 10);
+	check(!memcmp(small, "abc", 3));
+	check(small + 10 <= other || other + 16 <= small);
+
+	char *big = hipack_arena_alloc(arena, NULL, 100000);
+	memset(big, 'x', 100000);
+	big = hipack_arena_alloc(arena, big, 500000);
+	check(big[0] == 'x' && big[99999] == 'x');
+	check(!memcmp(small, "abc", 3));
+
+	hipack_arena_free(arena);
+	return TEST_PASS;
+}
+
+struct alloc_stats {
+	size_t allocs;
+	size_t frees;
+};
+
+static void*
+stats_alloc(void *user, void *optr, size_t size)
+{
+	struct alloc_stats *stats = user;
+	if (!optr)
+		stats->allocs++;
+	return hipack_alloc_stdlib(optr, size);
+}
+
+static void
+stats_free(void *user, void *ptr)
+{
+	struct alloc_stats *stats = user;
+	stats->frees++;
+	hipack_alloc_stdlib(ptr, 0);
+}
+
+TEST(read_allocator)
+{
+	struct alloc_stats stats = { 0, 0 };
+	const hipack_allocator_t allocator = {
+		.alloc = stats_alloc,
+		.free = stats_free,
+		.user = &stats,
+	};
+	hipack_reader_t reader = { .allocator = &allocator };
+
+	/* The global allocation function must not be used at all. */
+	alloc_count = 0;
+	hipack_alloc = counting_alloc;
+	hipack_dict_t *message =
+		hipack_read_buffer((const uint8_t*) test_message,
+		                   sizeof(test_message) - 1, &reader);
+	hipack_alloc = hipack_alloc_stdlib;
+	check(message);
+	check(alloc_count == 0);
+	check(stats.allocs > 0);
+
+	/* Values added to the dictionary are released with its allocator. */
+	hipack_string_t *key =
+		hipack_string_new_from_lstring_with_allocator(&allocator, "list", 4);
+	hipack_list_t *list = hipack_list_new_with_allocator(&allocator, 1);
+	list->data[0] = hipack_string(hipack_string_copy_with_allocator(&allocator, key));
+	hipack_value_t value = hipack_list(list);
+	hipack_dict_set_adopt_key(message, &key, &value);
+	check(hipack_dict_size(message) == 4);
+
+	hipack_dict_free(message);
+	check(stats.allocs == stats.frees);
+
+	return TEST_PASS;
+}
+
+TEST(read_intern)
+{
+	hipack_intern_t *pool = hipack_intern_new();
+	hipack_reader_t reader = { .intern = pool };
+	hipack_dict_t *first =
+		hipack_read_buffer((const uint8_t*) test_message,
+		                   sizeof(test_message) - 1, &reader);
+	check(first);
+
+	/* Keys already in the pool do not need allocating. */
+	reader = (hipack_reader_t) { .intern = pool };
+	alloc_count = 0;
+	hipack_alloc = counting_alloc;
+	hipack_dict_t *second =
+		hipack_read_buffer((const uint8_t*) test_message,
+		                   sizeof(test_message) - 1, &reader);
+	hipack_alloc = hipack_alloc_stdlib;
+	check(second);
+
+	reader = (hipack_reader_t) { 0 };
+	hipack_dict_t *expected cleanup(dict) =
+		hipack_read_buffer((const uint8_t*) test_message,
+		                   sizeof(test_message) - 1, &reader);
+	check(expected);
+	check(hipack_dict_equal(expected, first));
+	check(hipack_dict_equal(expected, second));
+
+	/* Short keys are copied into the dictionaries, even when interned. */
+	const hipack_string_t *key1, *key2;
+	hipack_value_t *value1 = hipack_dict_first(first, &key1);
+	hipack_value_t *value2 = hipack_dict_first(second, &key2);
+	check(value1 && value2 && hipack_string_equal(key1, key2));
+	hipack_string_t *title = hipack_string_new_from_string("title");
+	check(hipack_intern(pool, title) == hipack_intern(pool, title));
+	check(hipack_dict_get(second, hipack_intern(pool, title)) == value2);
+	hipack_string_free(title);
+
+	/* Messages share long keys, which can be used for lookups. */
+	static const char long_key_message[] = "a-key-longer-than-inline-keys: 1\n";
+	reader = (hipack_reader_t) { .intern = pool };
+	hipack_dict_t *long_first =
+		hipack_read_buffer((const uint8_t*) long_key_message,
+		                   sizeof(long_key_message) - 1, &reader);
+	reader = (hipack_reader_t) { .intern = pool };
+	hipack_dict_t *long_second =
+		hipack_read_buffer((const uint8_t*) long_key_message,
+		                   sizeof(long_key_message) - 1, &reader);
+	check(long_first && long_second);
+	value1 = hipack_dict_first(long_first, &key1);
+	value2 = hipack_dict_first(long_second, &key2);
+	check(value1 && value2 && key1 == key2);
+	check(hipack_dict_get(long_first, key2) == value1);
+	hipack_dict_free(long_first);
+	hipack_dict_free(long_second);
+
+	/* Short keys are not allocated either without interning. */
+	size_t count = alloc_count;
+	reader = (hipack_reader_t) { 0 };
+	alloc_count = 0;
+	hipack_alloc = counting_alloc;
+	hipack_dict_free(hipack_read_buffer((const uint8_t*) test_message,
+	                                    sizeof(test_message) - 1, &reader));
+	hipack_alloc = hipack_alloc_stdlib;
+	check(count == alloc_count);
+
+	hipack_dict_free(first);
+	hipack_dict_free(second);
+	hipack_intern_free(pool);
+	return TEST_PASS;
+}
+
+TEST(value_annot)
+{
+	hipack_value_t value cleanup(value) = hipack_bool(true);
+	const hipack_string_t *annot;
+	const char *names[] = { "first", "second", "a-longer-third-name" };
+
+	/* Annotations are kept in a single block, allocated once. */
+	alloc_count = 0;
+	hipack_alloc = counting_alloc;
+	for (unsigned i = 0; i < 3; i++)
+		hipack_value_add_annot(&value, names[i]);
+	hipack_value_add_annot(&value, "second");
+	check(hipack_value_has_annot(&value, "first"));
+	check(!hipack_value_has_annot(&value, "firs"));
+	hipack_value_del_annot(&value, "missing");
+	hipack_alloc = hipack_alloc_stdlib;
+	check(alloc_count == 1);
+
+	unsigned n = 0;
+	HIPACK_ANNOT_FOREACH(&value, annot) {
+		check(n < 3);
+		check(annot->size == strlen(names[n]));
+		check(!memcmp(annot->data, names[n], annot->size));
+		n++;
+	}
+	check(n == 3);
+	/* The type is stored along with the pointer to the annotations. */
+	check(hipack_value_is_bool(&value) && hipack_value_get_bool(&value));
+	check(sizeof(hipack_value_t) <= 16);
+
+	/* Removing an annotation keeps the order of the rest. */
+	hipack_value_del_annot(&value, "second");
+	check(!hipack_value_has_annot(&value, "second"));
+	annot = hipack_value_annot_next(&value, NULL);
+	check(annot && annot->size == 5);
+	annot = hipack_value_annot_next(&value, annot);
+	check(annot && annot->size == strlen(names[2]));
+	check(!hipack_value_annot_next(&value, annot));
+
+	/* Growing the block keeps the annotations. */
+	char name[8];
+	for (unsigned i = 0; i < 100; i++) {
+		snprintf(name, sizeof(name), "n%u", i);
+		hipack_value_add_annot(&value, name);
+	}
+	check(hipack_value_has_annot(&value, "first"));
+	check(hipack_value_has_annot(&value, "n0"));
+	check(hipack_value_has_annot(&value, "n99"));
+
+	/* The block is released along with the last annotation. */
+	hipack_value_del_annot(&value, "first");
+	hipack_value_del_annot(&value, names[2]);
+	for (unsigned i = 0; i < 100; i++) {
+		snprintf(name, sizeof(name), "n%u", i);
+		hipack_value_del_annot(&value, name);
+	}
+	check(!hipack_value_annot(&value));
+
+	/* Intrinsic annotations are not stored. */
+	static const char message[] = "value :.int :unit :checked 42\n";
+	hipack_reader_t reader = { 0 };
+	hipack_dict_t *dict cleanup(dict) =
+		hipack_read_buffer((const uint8_t*) message, sizeof(message) - 1,
+		                   &reader);
+	check(dict);
+	hipack_value_t *v = hipack_dict_get_string(dict, "value");
+	check(v && hipack_value_is_integer(v));
+	check(hipack_value_has_annot(v, "unit"));
+	check(hipack_value_has_annot(v, "checked"));
+	check(!hipack_value_has_annot(v, ".int"));
+	return TEST_PASS;
+}
+
+struct output {
+	uint8_t *data;
+	size_t size;
+	size_t alloc;
+	unsigned calls;
+	bool fail;
+};
+
+static int
+output_write(void *data, const uint8_t *buffer, size_t size)
+{
+	struct output *out = data;
+	out->calls++;
+	if (out->fail)
+		return HIPACK_IO_ERROR;
+	if (out->size + size > out->alloc) {
+		out->alloc = (out->size + size) * 2;
+		out->data = realloc(out->data, out->alloc);
+	}
+	memcpy(out->data + out->size, buffer, size);
+	out->size += size;
+	return (int) size;
+}
+
+static int
+output_putchar(void *data, int ch)
+{
+	uint8_t byte = ch;
+	return output_write(data, &byte, 1);
+}
+
+/* A message which does not fit in the output buffer of the writer. */
+static hipack_dict_t*
+make_big_message(void)
+{
+	hipack_dict_t *message = hipack_dict_new();
+	hipack_list_t *list = hipack_list_new(3000);
+	for (uint32_t i = 0; i < list->size; i++) {
+		list->data[i] = hipack_integer(i);
+		if (i % 7 == 0)
+			hipack_value_add_annot(&list->data[i], "seventh");
+	}
+	hipack_string_t *key = hipack_string_new_from_string("items");
+	hipack_value_t value = hipack_list(list);
+	hipack_dict_set_adopt_key(message, &key, &value);
+	key = hipack_string_new_from_string("title");
+	value = hipack_string(hipack_string_new_from_string("Quick \"brown\" fox\n"));
+	hipack_dict_set_adopt_key(message, &key, &value);
+	return message;
+}
+
+TEST(write_blocks)
+{
+	hipack_dict_t *message cleanup(dict) = make_big_message();
+
+	struct output expected = { 0 };
+	hipack_writer_t writer = {
+		.putchar = output_putchar,
+		.putchar_data = &expected,
+	};
+	check(!hipack_write(&writer, message));
+
+	struct output out = { 0 };
+	writer = (hipack_writer_t) {
+		.write = output_write,
+		.write_data = &out,
+	};
+	bool failed = hipack_write(&writer, message);
+	bool same = (out.size == expected.size) &&
+		!memcmp(out.data, expected.data, out.size);
+	unsigned calls = out.calls;
+	free(out.data);
+	free(expected.data);
+	check(!failed);
+	check(same);
+	check(calls > 1 && calls < 10);
+	check(!writer.buffer);
+
+	/* Writing a single value also flushes the buffer. */
+	out = (struct output) { 0 };
+	check(!hipack_write_value(&writer, hipack_dict_get_string(message, "title")));
+	static const char title[] = "\"Quick \\\"brown\\\" fox\\n\"";
+	same = (out.size == sizeof(title) - 1) && !memcmp(out.data, title, out.size);
+	free(out.data);
+	check(same);
+
+	out = (struct output) { .fail = true };
+	check(hipack_write(&writer, message));
+	check(out.calls == 1);
+	check(!writer.buffer);
+
+	return TEST_PASS;
+}
+
+TEST(write_to_buffer)
+{
+	hipack_dict_t *message cleanup(dict) = make_big_message();
+
+	for (int32_t indent = HIPACK_WRITER_COMPACT; indent <= HIPACK_WRITER_INDENTED; indent++) {
+		struct output expected = { 0 };
+		hipack_writer_t writer = {
+			.putchar = output_putchar,
+			.putchar_data = &expected,
+			.indent = indent,
+		};
+		check(!hipack_write(&writer, message));
+
+		size_t size = hipack_write_size(message, indent);
+		size_t length[2];
+		uint8_t *data[2];
+		for (unsigned exact = 0; exact < 2; exact++)
+			data[exact] = hipack_write_to_buffer(message, indent, exact, &length[exact]);
+
+		bool same = (size == expected.size);
+		for (unsigned exact = 0; exact < 2; exact++) {
+			same = same && length[exact] == expected.size &&
+				!memcmp(data[exact], expected.data, expected.size) &&
+				data[exact][length[exact]] == '\0';
+			hipack_alloc_free(data[exact]);
+		}
+		free(expected.data);
+		check(same);
+	}
+
+	hipack_dict_t *empty cleanup(dict) = hipack_dict_new();
+	size_t length;
+	uint8_t *data = hipack_write_to_buffer(empty, HIPACK_WRITER_INDENTED, true, &length);
+	bool is_empty = (length == 0) && (data[0] == '\0');
+	hipack_alloc_free(data);
+	check(is_empty);
+
+	return TEST_PASS;
+}
+
+TEST(write_integer)
+{
+	static const struct {
+		int64_t value;
+		const char *text;
+	} numbers[] = {
+		{ 0, "0" }, { 7, "7" }, { -7, "-7" }, { 10, "10" }, { 99, "99" },
+		{ 100, "100" }, { -1000, "-1000" }, { 4294967296, "4294967296" },
+		{ INT64_MAX, "9223372036854775807" },
+		{ INT64_MIN, "-9223372036854775808" },
+	};
+	for (size_t i = 0; i < sizeof(numbers) / sizeof(numbers[0]); i++) {
+		struct output out = { 0 };
+		hipack_writer_t writer = {
+			.putchar = output_putchar,
+			.putchar_data = &out,
+		};
+		check(!hipack_write_integer(&writer, numbers[i].value));
+		bool same = (out.size == strlen(numbers[i].text)) &&
+			!memcmp(out.data, numbers[i].text, out.size);
+		free(out.data);
+		check(same);
+	}
+	return TEST_PASS;
+}
+
+TEST(write_string_escapes)
+{
+	/* Every byte value, at every alignment of the scanners. */
+	uint8_t bytes[256 + 64];
+	for (size_t i = 0; i < sizeof(bytes); i++)
+		bytes[i] = (uint8_t) (i * 7);
+
+	hipack_dict_t *message cleanup(dict) = hipack_dict_new();
+	for (uint32_t i = 0; i < 64; i++) {
+		char name[16];
+		hipack_string_t *key = hipack_string_new_from_lstring(name,
+				snprintf(name, sizeof(name), "s%u", i));
+		hipack_value_t value = hipack_string(
+				hipack_string_new_from_lstring((const char*) bytes + i, 256));
+		hipack_dict_set_adopt_key(message, &key, &value);
+	}
+
+	size_t length;
+	uint8_t *data = hipack_write_to_buffer(message, HIPACK_WRITER_COMPACT, false, &length);
+	hipack_reader_t reader = { 0 };
+	hipack_dict_t *result cleanup(dict) = hipack_read_buffer(data, length, &reader);
+	hipack_alloc_free(data);
+	check(result);
+	check(hipack_dict_equal(message, result));
+
+	return TEST_PASS;
+}
+
+typedef const uint8_t* (*scan_func_t)(const uint8_t*, const uint8_t*);
+
+/*
+ * Places each of the "stops" bytes at every position of a buffer filled
+ * with "fill", and checks that the scanner finds it at the right position.
+ */
+static bool
+check_scanner(scan_func_t scan, scan_func_t reference, uint8_t fill,
+              const char *stops, size_t n_stops)
+{
+	uint8_t buffer[80];
+	for (size_t length = 0; length <= sizeof(buffer); length++) {
+		memset(buffer, fill, sizeof(buffer));
+		if (scan(buffer, buffer + length) != reference(buffer, buffer + length))
+			return false;
+		for (size_t i = 0; i < n_stops; i++) {
+			for (size_t pos = 0; pos < length; pos++) {
+				memset(buffer, fill, sizeof(buffer));
+				buffer[pos] = stops[i];
+				if (scan(buffer, buffer + length) != reference(buffer, buffer + length))
+					return false;
+			}
+		}
+	}
+	return true;
+}
+
+TEST(scan)
+{
+	/* Control characters are valid in keys, but not whitespace. */
+	static const char key_stops[] = "\t\n\r []{}:,#\x01\x1F\xFB";
+	static const char string_stops[] = "\"\\\x02\xA2";
+	static const char ws_stops[] = "a\x01\x09\x0A\x0D\x20\xA0";
+	static const char escape_stops[] = "\"\\\x01\x0A\x1F \x7F\xA2";
+
+#define CHECK_SCANNER(name, variant, fill, stops) \
+	check(check_scanner(hipack_scan_ ## name ## variant, hipack_scan_ ## name ## _bytes, \
+	                    fill, stops, sizeof(stops) - 1))
+
+	CHECK_SCANNER(string, , 'a', string_stops);
+	CHECK_SCANNER(key, , 'k', key_stops);
+	CHECK_SCANNER(whitespace, , ' ', ws_stops);
+	CHECK_SCANNER(whitespace, , '\n', ws_stops);
+	CHECK_SCANNER(escape, , 'a', escape_stops);
+
+	/* Variants other than the one picked by the dispatcher. */
+	CHECK_SCANNER(string, _swar, 'a', string_stops);
+	CHECK_SCANNER(whitespace, _swar, '\t', ws_stops);
+	CHECK_SCANNER(escape, _swar, 'a', escape_stops);
+#if HIPACK_SCAN_SSE2
+	CHECK_SCANNER(string, _sse2, 'a', string_stops);
+	CHECK_SCANNER(whitespace, _sse2, '\r', ws_stops);
+	CHECK_SCANNER(escape, _sse2, '\xA0', escape_stops);
+#endif
+#if HIPACK_SCAN_AVX2
+	if (hipack_scan_have_avx2()) {
+		CHECK_SCANNER(string, _avx2, 'a', string_stops);
+		CHECK_SCANNER(whitespace, _avx2, ' ', ws_stops);
+		CHECK_SCANNER(escape, _avx2, '\xA0', escape_stops);
+	}
+#endif
+
+#undef CHECK_SCANNER
+	return TEST_PASS;
+}
+
+/* Checks that the result is the same double returned by strtod(). */
+static bool
+check_float(const char *text)
+{
+	double value, expected = strtod(text, NULL);
+	return hipack_float_parse(text, strlen(text), &value) &&
+		!memcmp(&value, &expected, sizeof(double));
+}
+
+TEST(float_parse)
+{
+	static const char *valid[] = {
+		"0", "-0.0", "1.", ".5", "-.5e1", "0.1", "1e23", "3.0000000000000004e-1",
+		/* Exactly halfway between two doubles, and right around it. */
+		"9007199254740993", "9007199254740993.0000000000000000001",
+		"1.00000000000000011102230246251565404236316680908203125",
+		"1.00000000000000011102230246251565404236316680908203124",
+		/* Largest and smallest normal and subnormal numbers. */
+		"1.7976931348623157e308", "1.7976931348623159e308", "1e400",
+		"2.2250738585072014e-308", "2.2250738585072011e-308",
+		"4.9406564584124654e-324", "2.4703282292062327e-324", "1e-400",
+		/* More than 19 significant digits. */
+		"123456789012345678901234567890",
+		"0.000000000000000000000000000000000000000001234567890123456789012",
+		"0000000000000000000000000000000000000000000001.5",
+	};
+	for (size_t i = 0; i < sizeof(valid) / sizeof(valid[0]); i++)
+		check(check_float(valid[i]));
+
+	char buffer[40];
+	uint64_t bits = UINT64_C(0x9E3779B97F4A7C15);
+	for (unsigned i = 0; i < 100000; i++) {
+		double d;
+		bits ^= bits << 13; bits ^= bits >> 7; bits ^= bits << 17;
+		memcpy(&d, &bits, sizeof(double));
+		if (d != d || d - d != 0.0)  /* NaN or infinity. */
+			continue;
+		snprintf(buffer, sizeof(buffer), "%.17g", d);
+		check(check_float(buffer));
+		snprintf(buffer, sizeof(buffer), "%.*e", i % 17, d);
+		check(check_float(buffer));
+	}
+
+	static const char *invalid[] = {
+		"", ".", "-", "e5", "1e", "1e+", "1.5a", "--1", "1..2", "1e5.0",
+		"0x1p3", "inf", "nan",
+	};
+	for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++) {
+		double value;
+		check(!hipack_float_parse(invalid[i], strlen(invalid[i]), &value));
+	}
+	return TEST_PASS;
+}
+
 #undef TEST
 
 static size_t stat_skipped = 0;
@@ -137,6 +1179,25 @@ main(int argc, char *argv[])
 #define TEST(name) { #name, test_ ## name }
 		TEST(value_equal),
 		TEST(list_equal),
+		TEST(string_hash),
+		TEST(dict_set_del),
+		TEST(dict_reserve),
+		TEST(dict_concurrent_get),
+		TEST(dict_freeze),
+		TEST(dict_get_lstring),
+		TEST(read_chunked),
+		TEST(read_buffer),
+		TEST(read_file),
+		TEST(read_arena),
+		TEST(read_allocator),
+		TEST(read_intern),
+		TEST(value_annot),
+		TEST(write_blocks),
+		TEST(write_to_buffer),
+		TEST(write_integer),
+		TEST(write_string_escapes),
+		TEST(scan),
+		TEST(float_parse),
 #undef TEST
 	};
 